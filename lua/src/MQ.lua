@@ -1,5 +1,8 @@
 local MQ = {}
 
+-- formats into the output without building the line as a Lua string
+local printf, log = Luatt.printf, Luatt.log
+
 local function topic_to_pattern (topic)
     local tail = string.sub(topic, -1) == "#"
     if tail then
@@ -17,9 +20,15 @@ end
 MQ.Topics = {}
 MQ.WildcardTopics = {}
 
+-- Print every message received. Code that mustn't allocate per message
+-- turns it off, the line is only built when it's on.
+MQ.log = true
+
 function MQ.OnMessage (topic, payload)
-    print("log: got msg(" .. topic .. ", " .. payload .. ")")
-    cb = MQ.Topics[topic]
+    if MQ.log then
+        log("log: got msg(%s, %s)", topic, payload)
+    end
+    local cb = MQ.Topics[topic]
     if not cb then
         for _, pat_cb in pairs(MQ.WildcardTopics) do
             if string.find(topic, pat_cb[1]) then
@@ -42,17 +51,25 @@ function MQ.Subscribe (topic, callback)
     else
         MQ.Topics[topic] = callback
     end
-    print("sub|" .. topic)
+    printf("sub|%s\n", topic)
 end
 
 function MQ.Unsubscribe (topic)
-    print("unsub|" .. topic)
+    printf("unsub|%s\n", topic)
     MQ.Topics[topic] = nil
     MQ.WildcardTopics[topic] = nil
 end
 
 function MQ.Publish (topic, payload)
-    print("pub|" .. topic .. "|" .. payload)
+    printf("pub|%s|%s\n", topic, payload)
+end
+
+-- Drop all subscriptions. Called by Lua_Soft_Reset().
+function MQ.reset ()
+    print("unsub|*")
+    MQ.Topics = {}
+    MQ.WildcardTopics = {}
+    Luatt.set_cb_on_msg(MQ.OnMessage)
 end
 
 Luatt.set_cb_on_msg(MQ.OnMessage)
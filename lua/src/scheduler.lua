@@ -1,4 +1,8 @@
 local time = Luatt.time
+-- Luatt functions are looked up in ROM tables, keep the hot ones here
+local resume, set_mux_token, wake = Luatt.resume, Luatt.set_mux_token, Luatt.wake
+local release_mux_token = Luatt.release_mux_token
+local SCHED = Luatt.mux_token("sched")
 
 local scheduler = {}
 
@@ -15,6 +19,15 @@ scheduler.interrupts = {}
 scheduler.tokens = {}
 scheduler.args = {}
 
+-- Forget a thread that has ended. Its mux token is released now so the
+-- id can be reused without waiting for the GC.
+local function forget (co)
+    release_mux_token(scheduler.tokens[co])
+    scheduler.tokens[co] = nil
+    scheduler.interrupts[co] = nil
+    coroutine.close(co)
+end
+
 -- Called by the main Arduino loop.
 -- The C code looks up "scheduler.loop" in the Lua global scope and calls it.
 -- Returns the number of millseconds the system should sleep.
@@ -47,27 +60,31 @@ function scheduler.loop (ints)
         local r, t_inc, co_ints, args
         co = scheduler.pq:dequeue()
         co_ints = scheduler.interrupts[co] or 0
-        scheduler.interrupts[co] = nil
+        -- 0 rather than nil keeps the key's slot, so the table doesn't
+        -- rehash when the thread waits again
+        if co_ints ~= 0 then scheduler.interrupts[co] = 0 end
 
         args = scheduler.args[co]
         scheduler.args[co] = nil
 
         if coroutine.status(co) == "dead" then
             -- coroutine was closed from another thread
-            scheduler.tokens[co] = nil
-            coroutine.close(co)
+            forget(co)
             goto continue
         end
 
         -- Run thread coroutine.
-        Luatt.set_mux_token(scheduler.tokens[co])
+        set_mux_token(scheduler.tokens[co])
+        -- Luatt.resume preempts threads that run past their budget,
+        -- they come back like a plain yield and run again next.
         -- scheduler.args[] is only for the first resume (the function args)
         if args == nil then
             -- subsequently, these are returned by yield()
-            args = { ms, ints & co_ints }
+            r, t_inc, co_ints = resume(co, ms, ints & co_ints)
+        else
+            r, t_inc, co_ints = resume(co, table.unpack(args, 1, args.n))
         end
-        r, t_inc, co_ints = coroutine.resume(co, table.unpack(args, 1, args.n))
-        Luatt.set_mux_token("sched")
+        set_mux_token(SCHED)
 
         if coroutine.status(co) == "dead" then
             -- coroutine has exited
@@ -75,8 +92,7 @@ function scheduler.loop (ints)
                 -- because of error
                 print("Error: " .. t_inc)
             end
-            scheduler.tokens[co] = nil
-            coroutine.close(co)
+            forget(co)
         else
             -- coroutine wants to sleep
             t_inc = t_inc or 0
@@ -98,14 +114,51 @@ function scheduler.start (co, t_inc, ...)
     scheduler.tokens[co] = Luatt.get_mux_token()
     scheduler.args[co] = table.pack(...)
     scheduler.pq:enqueue(co, time.millis() + math.floor(t_inc or 0))
+    wake()
+end
+
+-- Run a chunk from the loader's aeval command as a new thread.
+-- The chunk may yield like any other thread. Results are printed
+-- and the ret line sent when it finishes.
+function scheduler.spawn (fn)
+    local co = coroutine.create(function ()
+        local r = table.pack(pcall(fn))
+        if not r[1] then
+            print("error|aeval," .. tostring(r[2]))
+            print("ret|fail")
+            return
+        end
+        if r.n > 1 then
+            print(table.unpack(r, 2, r.n))
+        end
+        print("ret|ok")
+    end)
+    scheduler.start(co, 0)
 end
 
 -- Reschedule a thread to run after t_inc milliseconds.
 -- Can be used to wake up early.
 function scheduler.wake (co, t_inc)
     scheduler.pq:update(co, time.millis() + math.floor(t_inc or 0))
+    wake()
+end
+
+-- Drop all threads. Called by Lua_Soft_Reset().
+function scheduler.reset ()
+    while not scheduler.pq:empty() do
+        coroutine.close(scheduler.pq:dequeue())
+    end
+    for _, token in pairs(scheduler.tokens) do
+        release_mux_token(token)
+    end
+    scheduler.interrupts = {}
+    scheduler.tokens = {}
+    scheduler.args = {}
+    Luatt.set_cb_sched_loop(scheduler.loop)
+    Luatt.set_cb_spawn(scheduler.spawn)
 end
 
 Luatt.set_cb_sched_loop(scheduler.loop)
+Luatt.set_cb_spawn(scheduler.spawn)
 
 return scheduler
@@ -37,6 +37,31 @@
 #       does set hardware peripherals to their initial state. Clears all
 #       Lua variables, objects, frees memory, etc.
 #
+#   -s  Soft reset. Like -r, but keeps the core packages (scheduler, MQ)
+#       loaded and doesn't rebuild the Lua state, so it's much faster.
+#
+#   --force
+#       Send every module, even ones the micro reports it already has.
+#       Normally modules are skipped up to the first one that changed.
+#
+#   --watch
+#       Keep running and reload a .lua file as soon as it's saved.
+#
+#   --stage
+#       Staged reset. Build a new Lua state alongside the running one,
+#       load the files given on the command line into it, then switch
+#       over. If any file fails to load, the old app keeps running.
+#
+#   --stats=SECONDS
+#       Poll the micro's runtime counters and tick latency percentiles
+#       (tick_p99, late_p99, etc, microseconds) every SECONDS and append them
+#       as JSON lines to /tmp/luatt.stats.jsonl. Also published to the
+#       MQTT topic luatt/stats when --mqtt is used.
+#
+#   --state=NAME
+#       Send the following options to the named Lua state instead of
+#       "main". -r creates the state if the micro doesn't have it yet.
+#
 #   filename.lua    Load Lua file onto microcontroller and run it.
 #
 #   Loader.cmd      Text file with a list of .lua files to load. Loads
@@ -54,7 +79,25 @@
 #
 # REPL meta commands, they work like the command line options.
 #   !reset
+#   !reset soft
 #   !load file.lua
+#   !async lua code     Run as a scheduler thread, so it can yield.
+#   !stage              Start a staged reset, then !load files...
+#   !commit             Switch to the staged state.
+#   !abort              Discard the staged state.
+#   !state [name]       Send following commands to a named Lua state.
+#   !close name         Remove a named Lua state.
+#   !stats              Show runtime counters and tick latency.
+#   !prof start [us]    Start the sampling profiler, default every 1000us.
+#   !prof stop
+#   !prof dump [file]   Save folded stacks for flamegraph.pl, default
+#                       luatt.folded. Appends to an existing file.
+#   !snap [file] [n]    Heap snapshot: objects by type and the n largest
+#                       tables (default 10). Saved as JSON to file,
+#                       default luatt.snap.json.
+#   !snapdiff a b       Compare two saved snapshots, largest growth
+#                       first. Also works without a micro:
+#                       $ python3 luatt.py --snapdiff a.json b.json
 
 
 import ctypes
@@ -76,6 +119,7 @@ import signal
 import socket
 import socketserver
 import stat
+import struct
 import sys
 import termios
 import threading
@@ -112,8 +156,15 @@ ReplQ = queue.Queue(20)
 
 Downstreams = {}
 
+# Binary log formats by id, from logfmt lines. See luatt_log.h.
+Log_Formats = {}
+
 Quit = False
 Force_Update = False
+Force_Load = False
+
+# Named Lua state on the micro that commands go to, None for "main".
+Target_State = None
 
 Conn = {}
 
@@ -421,6 +472,74 @@ def read_packet_bytes(fd, n, partial):
     line = b''.join(line)
     return (line[:n], line[n:][1:]) # skip newline
 
+# Undo the escaping of log lines, ESC then the byte ^ 0x20.
+def log_unescape(b):
+    if b'\x1b' not in b: return b
+    out = bytearray()
+    i = 0
+    while i < len(b):
+        if b[i] == 0x1b and i + 1 < len(b):
+            out.append(b[i + 1] ^ 0x20)
+            i += 2
+        else:
+            out.append(b[i])
+            i += 1
+    return bytes(out)
+
+def log_varint(b, i):
+    v = shift = 0
+    while True:
+        c = b[i]
+        i += 1
+        v |= (c & 0x7f) << shift
+        shift += 7
+        if c < 0x80: return v, i
+
+Pat_log_conv = re.compile(rb'%([-+ #0]*\d*(?:\.\d*)?)(?:hh|h|ll|l)?([diucoxXeEfFgGs%])')
+
+# Expand a log line's binary args into its format.
+def log_expand(fmt, args):
+    i = 0
+    def conv(m):
+        nonlocal i
+        spec, c = m.group(1).decode(), m.group(2)
+        if c == b'%': return b'%'
+        if c in b'eEfFgG':
+            v = struct.unpack_from('<d', args, i)[0]
+            i += 8
+        elif c == b's':
+            n, i = log_varint(args, i)
+            v = decode_or_repr(args[i:i+n])
+            i += n
+        else:
+            v, i = log_varint(args, i)
+            if c in b'dic': v = (v >> 1) ^ -(v & 1)
+        c = 'd' if c in b'iu' else c.decode()
+        return (f'%{spec}{c}' % v).encode('utf-8')
+    return Pat_log_conv.sub(conv, fmt)
+
+# Microcontroller names a log format.
+def dev_cmd_logfmt(cmd):
+    if len(cmd) != 4:
+        logger.error("logfmt: 4 args required, %d given", len(cmd))
+        return
+    Log_Formats[int(cmd[2])] = log_unescape(cmd[3])
+    logger.debug("logfmt %s: %s", coerce_string(cmd[2]), Log_Formats[int(cmd[2])])
+
+# Turn a log line back into the packet it stands for.
+def dev_cmd_log(cmd):
+    args = log_unescape(b'|'.join(cmd[3:]))
+    fmt = Log_Formats.get(int(cmd[2]))
+    if fmt is None:
+        logger.error("log: unknown format %s", coerce_string(cmd[2]))
+        return (cmd[0], b'log', cmd[2], args.hex().encode())
+    try:
+        line = log_expand(fmt, args)
+    except (IndexError, struct.error, TypeError, ValueError, OverflowError) as e:
+        logger.error("log: bad args for format %s: %s", coerce_string(cmd[2]), e)
+        return (cmd[0], b'log', cmd[2], args.hex().encode())
+    return (cmd[0], *line.split(b'|'))
+
 # Microcontroller publishes MQTT message.
 def dev_cmd_pub(cmd):
     if len(cmd) != 4:
@@ -474,6 +593,15 @@ def process_serial_packet(packet):
     token = coerce_string(packet[0])
     cmd = coerce_string(packet[1])
 
+    # binary log lines
+    if cmd == 'logfmt':
+        dev_cmd_logfmt(packet)
+        return
+    elif cmd == 'log' and len(packet) >= 3:
+        packet = dev_cmd_log(packet)
+        if len(packet) < 2: return
+        cmd = coerce_string(packet[1])
+
     # MQTT commands
     if cmd == 'pub':
         dev_cmd_pub(packet)
@@ -655,13 +783,31 @@ def find_loader_cmd(z):
         subdir_loader = info
     return subdir_loader
 
-def cmd_reset():
+# Loader command name, routed to Target_State.
+def dev_cmd(cmd):
+    if Target_State: return f"{cmd}@{Target_State}"
+    return cmd
+
+def cmd_reset(soft=False):
     token = new_token()
     QS[token] = ReplQ
-    write_command(Conn['fd'], token, "reset")
+    if soft:
+        write_command(Conn['fd'], token, dev_cmd("reset"), "soft")
+    else:
+        write_command(Conn['fd'], token, dev_cmd("reset"))
     wait_for_ret(ReplQ, token)
     del QS[token]
 
+# cmd is "stage", "commit" or "abort".
+# Returns True if the micro replied ret|ok.
+def cmd_stage(cmd):
+    token = new_token()
+    QS[token] = ReplQ
+    write_command(Conn['fd'], token, dev_cmd(cmd))
+    v = wait_for_ret(ReplQ, token)
+    del QS[token]
+    return v is not None and len(v) > 2 and v[2] == b'ok'
+
 def split_lua_name(s):
     eq = s.split('=', 1)
     if len(eq) == 2 and '/' not in eq[0]:
@@ -704,17 +850,139 @@ Pat_lua_comments = re.compile(
 def strip_lua_comments(lua_code):
     return Pat_lua_comments.sub(only_newlines, lua_code)
 
-def load_data(name, data, compile=False):
+# FNV-1a, same as the module hash in luatt_loader.cpp.
+def fnv1a_32(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return h
+
+# Ask the micro for the hashes of the modules it has loaded.
+# Returns {name: hash}, empty if the firmware doesn't support it.
+def query_hashes(q=ReplQ):
     token = new_token()
-    QS[token] = ReplQ
-    n = len(data)
-    data = strip_lua_comments(data)
+    QS[token] = q
+    write_command(Conn['fd'], token, dev_cmd("hashes"))
+    hashes = {}
+    while not Quit:
+        v = q.get()
+        if coerce_string(v[0]) != token: continue
+        if v[1] == b'hash' and len(v) == 4:
+            hashes[coerce_string(v[2])] = int(v[3], 16)
+        elif v[1] == b'ret':
+            break
+    del QS[token]
+    return hashes
+
+def load_data(name, data, compile=False, q=ReplQ):
+    token = new_token()
+    QS[token] = q
     if compile: cmd = "compile"
     else: cmd = "load"
-    write_command(Conn['fd'], token, cmd, name, data)
-    wait_for_ret(ReplQ, token)
+    write_command(Conn['fd'], token, dev_cmd(cmd), name, data)
+    wait_for_ret(q, token)
     del QS[token]
 
+# Files to reload when edited, {path: [name, mtime, order]}, where order
+# is the [(name, path)] list the file was loaded with.
+Watched = {}
+
+# Load a list of (name, data, path) modules in order.
+# Modules the micro already has are skipped, up to the first one that
+# changed. Everything after that is sent again, since later modules
+# may hold references into the changed one.
+def load_modules(mods, compile=False, q=ReplQ):
+    if compile or Force_Load:
+        have = {}
+    else:
+        have = query_hashes(q)
+    changed = False
+    order = [(name, path) for name, data, path in mods if path]
+    for name, data, path in mods:
+        data = strip_lua_comments(data)
+        if path and not compile:
+            try:
+                Watched[path] = [name, os.stat(path).st_mtime, order]
+            except OSError:
+                pass
+        if not changed and have.get(name) == fnv1a_32(data.encode('utf-8')):
+            logger.info("%s: unchanged, skipped", name)
+            continue
+        changed = True
+        load_data(name, data, compile, q)
+
+StatsPath = os.path.join(LogDir, 'luatt.stats.jsonl')
+
+# Send the stats command, returns {"time": t, "states": {name: {...}}, ...}
+# The micro replies with comma separated key=value fields.
+def query_stats(q):
+    token = new_token()
+    QS[token] = q
+    write_command(Conn['fd'], token, "stats")
+    stats = {'time': time.time(), 'states': {}}
+    while not Quit:
+        v = q.get()
+        if coerce_string(v[0]) != token: continue
+        if v[1] == b'stats' and len(v) == 3:
+            rec = {}
+            for kv in coerce_string(v[2]).split(','):
+                k, _, val = kv.partition('=')
+                rec[k] = int(val) if val.isdigit() else val
+            if 'state' in rec:
+                stats['states'][rec.pop('state')] = rec
+            else:
+                stats.update(rec)
+        elif v[1] == b'ret':
+            break
+    del QS[token]
+    return stats
+
+# Thread for --stats, exports the counters for dashboards.
+def poll_stats(interval):
+    q = queue.Queue(20)
+    while not Quit:
+        line = json.dumps(query_stats(q))
+        try:
+            with open(StatsPath, 'a') as f:
+                f.write(line + "\n")
+        except OSError as e:
+            logger.error("%s: %s", StatsPath, e.strerror)
+        if paho_client is not None and hasattr(paho_client, 'publish'):
+            paho_client.publish("luatt/stats", line)
+        time.sleep(interval)
+
+# Thread for --watch, reloads modules when their file is saved.
+def watch_files():
+    q = queue.Queue(20)
+    while not Quit:
+        time.sleep(0.5)
+        # {id(order): [first changed index, order]}
+        reload = {}
+        for path, entry in list(Watched.items()):
+            try:
+                mtime = os.stat(path).st_mtime
+            except OSError:
+                continue
+            if mtime == entry[1]: continue
+            entry[1] = mtime
+            logger.warning("%s changed, reloading %s", path, entry[0])
+            order = entry[2]
+            i = order.index((entry[0], path))
+            r = reload.setdefault(id(order), [i, order])
+            r[0] = min(r[0], i)
+        # later modules may hold references into a changed one, send
+        # them too, load_modules still skips what the micro already has
+        for i, order in reload.values():
+            mods = []
+            for name, path in order[i:]:
+                try:
+                    mods.append((name, open(path, encoding='utf-8').read(), path))
+                except OSError as e:
+                    logger.error("%s: %s", path, e.strerror)
+                    mods = None
+                    break
+            if mods: load_modules(mods, q=q)
+
 def load_luaz(path, compile=False):
     with zipfile.ZipFile(path, metadata_encoding='utf-8') as z:
         loader = find_loader_cmd(z)
@@ -722,23 +990,27 @@ def load_luaz(path, compile=False):
             logger.error("%s: Loader.cmd not found", path)
             return None
         loader_dir = os.path.split(loader.filename)[0]
+        mods = []
         for line in z.read(loader).splitlines():
             line = line.decode('utf-8')
             if not line.strip(): continue
             name, src = split_lua_name(line)
             src_path = os.path.join(loader_dir, src)
             data = z.read(src_path).decode('utf-8')
-            load_data(name, data, compile)
+            mods.append((name, data, None))
+        load_modules(mods, compile)
 
 def load_loader_cmd(path, compile=False):
     loader_dir = os.path.split(path)[0]
+    mods = []
     for line in open(path).readlines():
         line = line.strip()
         if not line: continue
         name, src = split_lua_name(line)
         src_path = os.path.join(loader_dir, src)
         data = open(src_path).read()
-        load_data(name, data, compile)
+        mods.append((name, data, src_path))
+    load_modules(mods, compile)
 
 def cmd_load(cmd, compile=False):
     if len(cmd) < 2:
@@ -761,23 +1033,101 @@ def cmd_load(cmd, compile=False):
             logger.error("%s: %s", path, e.strerror)
             logger.error("Cannot load %s", path)
             return
-        load_data(name, data, compile)
+        load_modules([(name, data, path)], compile)
+
+# Profiler commands. dump appends the folded stacks to path.
+def cmd_prof(args, path='luatt.folded'):
+    token = new_token()
+    QS[token] = ReplQ
+    write_command(Conn['fd'], token, "prof", *args)
+    stacks = []
+    while not Quit:
+        v = ReplQ.get()
+        if coerce_string(v[0]) != token: continue
+        if v[1] == b'prof' and len(v) == 8 and v[2] == b'stats':
+            samples, kept, elapsed, overhead, full = map(int, v[3:8])
+            pct = 100.0 * overhead / elapsed if elapsed else 0
+            logger.info("prof: %i samples (%i kept), %.1f%% overhead, %i frames dropped",
+                samples, kept, pct, full)
+        elif v[1] == b'prof' and len(v) == 5 and v[2] == b'stack':
+            stacks.append(f"{coerce_string(v[3])} {int(v[4])}\n")
+        else:
+            sys.stdout.write(coerce_string(b'|'.join(v[1:])) + "\n")
+            if v[1] == b'ret': break
+    del QS[token]
+    if stacks:
+        with open(path, 'a') as f:
+            f.writelines(stacks)
+        logger.info("prof: %i stacks saved to %s", len(stacks), path)
 
-def cmd_eval(line):
+def cmd_snap(path='luatt.snap.json', top_n=10):
     token = new_token()
     QS[token] = ReplQ
-    write_command(Conn['fd'], token, "eval", line)
+    write_command(Conn['fd'], token, dev_cmd("snap"), str(top_n))
+    snap = {'time': time.time(), 'state': Target_State or 'main',
+            'types': {}, 'tables': {}}
+    while not Quit:
+        v = ReplQ.get()
+        if coerce_string(v[0]) != token: continue
+        if v[1] == b'snap' and len(v) == 6 and v[2] == b'type':
+            snap['types'][coerce_string(v[3])] = {'count': int(v[4]), 'bytes': int(v[5])}
+        elif v[1] == b'snap' and len(v) == 6 and v[2] == b'table':
+            snap['tables'][coerce_string(v[3])] = {'bytes': int(v[4]), 'entries': int(v[5])}
+        elif v[1] == b'snap' and len(v) == 6 and v[2] == b'total':
+            snap['total'] = {'objects': int(v[3]), 'bytes': int(v[4]), 'heap': int(v[5])}
+        else:
+            sys.stdout.write(coerce_string(b'|'.join(v[1:])) + "\n")
+            if v[1] == b'ret': break
+    del QS[token]
+    if 'total' not in snap:
+        return
+    t = snap['total']
+    logger.info("snap: %i objects, ~%i bytes of %i heap", t['objects'], t['bytes'], t['heap'])
+    for name, rec in sorted(snap['types'].items(), key=lambda kv: -kv[1]['bytes']):
+        print(f"{name:12} {rec['count']:8} {rec['bytes']:10}")
+    for name, rec in snap['tables'].items():
+        print(f"{rec['bytes']:10} {rec['entries']:8}  {name}")
+    with open(path, 'w') as f:
+        json.dump(snap, f, indent=1)
+    logger.info("snap: saved to %s", path)
+
+def snap_diff(path_a, path_b):
+    with open(path_a) as f: a = json.load(f)
+    with open(path_b) as f: b = json.load(f)
+    print(f"{b['time'] - a['time']:.0f} s apart, heap "
+          f"{a['total']['heap']} -> {b['total']['heap']} "
+          f"({b['total']['heap'] - a['total']['heap']:+})")
+    zero = {'count': 0, 'bytes': 0, 'entries': 0}
+    for section, count in (('types', 'count'), ('tables', 'entries')):
+        rows = []
+        for name in set(a[section]) | set(b[section]):
+            ra = a[section].get(name, zero)
+            rb = b[section].get(name, zero)
+            rows.append((rb['bytes'] - ra['bytes'], rb[count] - ra[count], rb['bytes'], name))
+        rows.sort(key=lambda r: -abs(r[0]))
+        print(f"{section}: bytes change, {count} change, bytes now")
+        for d_bytes, d_count, now, name in rows:
+            if d_bytes or d_count:
+                print(f"  {d_bytes:+10} {d_count:+8} {now:10}  {name}")
+
+def cmd_eval(line, run_async=False):
+    token = new_token()
+    QS[token] = ReplQ
+    if run_async: cmd = "aeval"
+    else: cmd = "eval"
+    write_command(Conn['fd'], token, dev_cmd(cmd), line)
     wait_for_ret(ReplQ, token)
     del QS[token]
 
 def parse_line(line):
+    global Target_State
     if line[:1] != '!':
         cmd_eval(line)
         return True
 
     args = shlex.split(line)
     if args[0] == '!reset':
-        cmd_reset()
+        cmd_reset(args[1:2] == ['soft'])
         return True
     elif args[0] == '!exit' or args[0] == '!quit':
         return False
@@ -787,6 +1137,48 @@ def parse_line(line):
     elif args[0] == '!compile':
         cmd_load(args, compile=True)
         return True
+    elif args[0] in ('!stage', '!commit', '!abort'):
+        cmd_stage(args[0][1:])
+        return True
+    elif args[0] == '!state':
+        Target_State = args[1] if len(args) > 1 and args[1] != 'main' else None
+        logger.info("Lua state: %s", Target_State or "main")
+        return True
+    elif args[0] == '!close':
+        if len(args) < 2:
+            logger.error("!close: no state given")
+        else:
+            token = new_token()
+            QS[token] = ReplQ
+            write_command(Conn['fd'], token, f"close@{args[1]}")
+            wait_for_ret(ReplQ, token)
+            del QS[token]
+        return True
+    elif args[0] == '!stats':
+        print(json.dumps(query_stats(ReplQ), indent=2))
+        return True
+    elif args[0] == '!prof':
+        if args[1:2] == ['dump'] and len(args) > 2:
+            cmd_prof(['dump'], args[2])
+        else:
+            cmd_prof(args[1:3])
+        return True
+    elif args[0] == '!snap':
+        cmd_snap(*args[1:3])
+        return True
+    elif args[0] == '!snapdiff':
+        if len(args) != 3:
+            logger.error("!snapdiff: two snapshot files needed")
+        else:
+            snap_diff(args[1], args[2])
+        return True
+    elif args[0] == '!async':
+        code = line.split(None, 1)[1:]
+        if not code:
+            logger.error("!async: no code given")
+        else:
+            cmd_eval(code[0], run_async=True)
+        return True
     elif args[0] == '!reload':
         pass
     else:
@@ -794,7 +1186,10 @@ def parse_line(line):
     return True
 
 def main():
-    global Quit, Force_Update
+    global Quit, Force_Update, Force_Load, Target_State
+    if sys.argv[1] == '--snapdiff' and len(sys.argv) == 4:
+        snap_diff(sys.argv[2], sys.argv[3])
+        return
     configure_logger()
     patch_readline()
     if not open_conn(sys.argv[1]):
@@ -818,6 +1213,8 @@ def main():
         tt_sec = math.floor(tt)
         tt_ms = math.floor(1e3 * (tt - tt_sec))
         write_command(Conn['fd'], "noret", "eval", f"Luatt.time.set_unix({tt_sec},{tt_ms})")
+        # log formats sent before we connected
+        write_command(Conn['fd'], "noret", "logfmt")
 
         Server = create_socket_and_symlink()
         Server_thread = threading.Thread(target=Server.serve_forever, daemon=True)
@@ -829,7 +1226,32 @@ def main():
         Server = None
         Server_thread = None
 
+    staged = False
+    watch = False
+    stats_interval = 0
     for arg in sys.argv[2:]:
+        if arg == '--force':
+            Force_Load = True
+            continue
+
+        if arg == '--watch':
+            watch = True
+            continue
+
+        if arg[:8] == '--stats=':
+            stats_interval = float(arg[8:])
+            continue
+
+        if arg[:8] == '--state=':
+            Target_State = arg[8:] if arg[8:] != 'main' else None
+            continue
+
+        if arg == '--stage':
+            staged = cmd_stage("stage")
+            if not staged:
+                logger.error("Staged reset failed, loading into running state.")
+            continue
+
         if arg[:7] == '--mqtt=':
             arg = arg.split("=", 1)[1]
             if Conn['is_socket']:
@@ -854,10 +1276,18 @@ def main():
             cmd_reset()
             continue
 
+        if arg == '-s':
+            cmd_reset(soft=True)
+            continue
+
         if arg[:5] == 'eval:':
             cmd_eval(arg[5:])
             continue
 
+        if arg[:6] == 'aeval:':
+            cmd_eval(arg[6:], run_async=True)
+            continue
+
         ext = os.path.splitext(arg)[1]
         if ext in ('.lua', '.luaz', '.zip', '.cmd'):
             cmd_load(['load', arg])
@@ -866,6 +1296,15 @@ def main():
         else:
             print(f"Error: bad command line arg {repr(arg)}")
 
+    if staged and not cmd_stage("commit"):
+        logger.error("Staged load failed, old app still running.")
+
+    if watch:
+        threading.Thread(target=watch_files, daemon=True).start()
+
+    if stats_interval > 0:
+        threading.Thread(target=poll_stats, args=(stats_interval,), daemon=True).start()
+
     if systemd and 'NOTIFY_SOCKET' in os.environ:
         systemd.daemon.notify('READY=1')
 
@@ -3,7 +3,13 @@
 
 #include "luatt_context.h"
 #include "luatt_loader.h"
+#include "luatt_output.h"
 #include "luatt_funcs.h"
+#include "luatt_bind.h"
+#include "luatt_prof.h"
+#include "luatt_rom.h"
+#include "luatt_snap.h"
+#include "luatt_log.h"
 #include "luatt_funcs_itsybitsy.h"
 #include "luatt_funcs_kb2040.h"
 
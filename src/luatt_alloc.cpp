@@ -0,0 +1,608 @@
+#include <string.h>
+
+#include "luatt_alloc.h"
+
+#define ALIGN 8
+
+static size_t align_up(size_t x) {
+    return (x + (ALIGN - 1)) & ~(size_t)(ALIGN - 1);
+}
+
+static int fls32(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+static int ffs32(uint32_t x) {
+    return __builtin_ctz(x);
+}
+
+///////////////////////////////////
+// TLSF
+
+// Second level lists per power of two.
+#define SL_LOG2 4
+#define SL_COUNT (1 << SL_LOG2)
+
+// Blocks smaller than this all go in first level list 0.
+#define FL_SHIFT (SL_LOG2 + 3)
+#define SMALL_BLOCK (1 << FL_SHIFT)
+
+// Blocks are smaller than 2^FL_MAX bytes.
+#define FL_MAX 20
+#define FL_COUNT (FL_MAX - FL_SHIFT + 1)
+
+#define BLOCK_FREE 1
+#define SIZE_MASK (((size_t)1 << FL_MAX) - ALIGN)
+
+// owner of a used block, in the bits above the size
+#define OWNER_SHIFT FL_MAX
+#define OWNER_MASK ((size_t)0xff << OWNER_SHIFT)
+
+struct Tlsf_Block {
+    Tlsf_Block* prev_phys;
+    size_t size;            // payload bytes | flags
+
+    // only valid while free, overlaps the payload
+    Tlsf_Block* next_free;
+    Tlsf_Block* prev_free;
+};
+
+#define BLOCK_HEADER offsetof(Tlsf_Block, next_free)
+#define BLOCK_MIN (sizeof(Tlsf_Block) - BLOCK_HEADER)
+
+static struct {
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[FL_COUNT];
+    Tlsf_Block* lists[FL_COUNT][SL_COUNT];
+
+    char* start;
+    size_t size;
+    size_t used;
+} Tlsf;
+
+static size_t block_size(const Tlsf_Block* b) {
+    return b->size & SIZE_MASK;
+}
+
+static bool block_is_free(const Tlsf_Block* b) {
+    return b->size & BLOCK_FREE;
+}
+
+static void* block_payload(Tlsf_Block* b) {
+    return (char*)b + BLOCK_HEADER;
+}
+
+static Tlsf_Block* block_from_payload(void* p) {
+    return (Tlsf_Block*)((char*)p - BLOCK_HEADER);
+}
+
+static Tlsf_Block* block_next(Tlsf_Block* b) {
+    return (Tlsf_Block*)((char*)block_payload(b) + block_size(b));
+}
+
+static void mapping_insert(size_t size, int* fl, int* sl) {
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK / SL_COUNT);
+    }
+    else {
+        int f = fls32(size);
+        *sl = (size >> (f - SL_LOG2)) ^ SL_COUNT;
+        *fl = f - (FL_SHIFT - 1);
+    }
+}
+
+// Round up so any block in the list found is big enough.
+static void mapping_search(size_t size, int* fl, int* sl) {
+    if (size >= SMALL_BLOCK) {
+        size += ((size_t)1 << (fls32(size) - SL_LOG2)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
+
+static void list_remove(Tlsf_Block* b) {
+    int fl, sl;
+    mapping_insert(block_size(b), &fl, &sl);
+    if (b->prev_free) b->prev_free->next_free = b->next_free;
+    else {
+        Tlsf.lists[fl][sl] = b->next_free;
+        if (!b->next_free) {
+            Tlsf.sl_bitmap[fl] &= ~(1u << sl);
+            if (!Tlsf.sl_bitmap[fl]) Tlsf.fl_bitmap &= ~(1u << fl);
+        }
+    }
+    if (b->next_free) b->next_free->prev_free = b->prev_free;
+}
+
+static void list_insert(Tlsf_Block* b) {
+    int fl, sl;
+    mapping_insert(block_size(b), &fl, &sl);
+    b->prev_free = 0;
+    b->next_free = Tlsf.lists[fl][sl];
+    if (b->next_free) b->next_free->prev_free = b;
+    Tlsf.lists[fl][sl] = b;
+    Tlsf.fl_bitmap |= 1u << fl;
+    Tlsf.sl_bitmap[fl] |= 1u << sl;
+}
+
+static Tlsf_Block* find_free(size_t size) {
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+    if (fl >= FL_COUNT) return 0;
+
+    uint32_t sl_map = Tlsf.sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint32_t fl_map = Tlsf.fl_bitmap & (~0u << (fl + 1));
+        if (!fl_map) return 0;
+        fl = ffs32(fl_map);
+        sl_map = Tlsf.sl_bitmap[fl];
+    }
+    sl = ffs32(sl_map);
+    return Tlsf.lists[fl][sl];
+}
+
+// Trim b to size, returning the remainder to the free lists.
+static void block_trim(Tlsf_Block* b, size_t size) {
+    size_t total = block_size(b);
+    if (total < size + BLOCK_HEADER + BLOCK_MIN) return;
+
+    Tlsf_Block* rest = (Tlsf_Block*)((char*)block_payload(b) + size);
+    rest->prev_phys = b;
+    rest->size = (total - size - BLOCK_HEADER) | BLOCK_FREE;
+    b->size = size | (b->size & ~SIZE_MASK);
+
+    Tlsf_Block* next = block_next(rest);
+    next->prev_phys = rest;
+    if (block_is_free(next)) {
+        // merge with following free block
+        list_remove(next);
+        rest->size += block_size(next) + BLOCK_HEADER;
+        block_next(rest)->prev_phys = rest;
+    }
+    list_insert(rest);
+}
+
+static size_t adjust_size(size_t size) {
+    size = align_up(size);
+    if (size < BLOCK_MIN) size = BLOCK_MIN;
+    return size;
+}
+
+static void* tlsf_malloc(size_t size) {
+    size = adjust_size(size);
+    if (size > SIZE_MASK) return 0;
+    Tlsf_Block* b = find_free(size);
+    if (!b) return 0;
+
+    list_remove(b);
+    b->size &= ~(size_t)BLOCK_FREE;
+    block_trim(b, size);
+    Tlsf.used += block_size(b) + BLOCK_HEADER;
+    return block_payload(b);
+}
+
+static void tlsf_free(void* p) {
+    Tlsf_Block* b = block_from_payload(p);
+    Tlsf.used -= block_size(b) + BLOCK_HEADER;
+    b->size = block_size(b) | BLOCK_FREE;
+
+    Tlsf_Block* prev = b->prev_phys;
+    if (prev && block_is_free(prev)) {
+        list_remove(prev);
+        prev->size += block_size(b) + BLOCK_HEADER;
+        b = prev;
+        block_next(b)->prev_phys = b;
+    }
+    Tlsf_Block* next = block_next(b);
+    if (block_is_free(next)) {
+        list_remove(next);
+        b->size += block_size(next) + BLOCK_HEADER;
+        block_next(b)->prev_phys = b;
+    }
+    list_insert(b);
+}
+
+// Resize in place if possible.
+static bool tlsf_resize(void* p, size_t size) {
+    Tlsf_Block* b = block_from_payload(p);
+    size = adjust_size(size);
+    size_t old = block_size(b);
+    if (size > old) {
+        Tlsf_Block* next = block_next(b);
+        if (!block_is_free(next)) return false;
+        size_t avail = old + BLOCK_HEADER + block_size(next);
+        if (avail < size || avail > SIZE_MASK) return false;
+        list_remove(next);
+        b->size += block_size(next) + BLOCK_HEADER;
+        block_next(b)->prev_phys = b;
+    }
+    block_trim(b, size);
+    Tlsf.used += block_size(b);
+    Tlsf.used -= old;
+    return true;
+}
+
+static bool tlsf_begin(char* mem, size_t size) {
+    memset(&Tlsf, 0, sizeof(Tlsf));
+    size &= ~(size_t)(ALIGN - 1);
+    if (size < 2 * BLOCK_HEADER + BLOCK_MIN) return false;
+    size_t payload = size - 2 * BLOCK_HEADER;
+    if (payload > SIZE_MASK) {
+        payload = SIZE_MASK;
+        size = payload + 2 * BLOCK_HEADER;
+    }
+
+    Tlsf.start = mem;
+    Tlsf.size = size;
+
+    Tlsf_Block* b = (Tlsf_Block*) mem;
+    b->prev_phys = 0;
+    b->size = payload | BLOCK_FREE;
+
+    // zero size sentinel, never free
+    Tlsf_Block* end = block_next(b);
+    end->prev_phys = b;
+    end->size = 0;
+
+    list_insert(b);
+    return true;
+}
+
+///////////////////////////////////
+// Pools
+
+#define POOL_PAGE 256
+#define POOL_CLASSES 8
+#define POOL_MAX (POOL_CLASSES * ALIGN)
+#define PAGE_UNUSED 0xff
+
+struct Pool_Slot {
+    Pool_Slot* next;
+};
+
+static struct {
+    char* start;
+    char* end;
+    uint8_t* page_class;    // per page size class, or PAGE_UNUSED
+#if LUATT_ALLOC_OWNERS
+    uint8_t* owner;         // per 8 byte unit, owner of the slot there
+#endif
+    size_t pages;
+    size_t pages_used;
+
+    Pool_Slot* free[POOL_CLASSES];
+    size_t slots_used[POOL_CLASSES];
+    size_t slots_free[POOL_CLASSES];
+    uint32_t fallbacks;
+} Pool;
+
+static int pool_class(size_t size) {
+    return (size - 1) / ALIGN;
+}
+
+static size_t class_size(int c) {
+    return (c + 1) * ALIGN;
+}
+
+static bool in_pool(const void* p) {
+    return (const char*)p >= Pool.start && (const char*)p < Pool.end;
+}
+
+static int page_of(const void* p) {
+    return ((const char*)p - Pool.start) / POOL_PAGE;
+}
+
+static void* pool_malloc(size_t size) {
+    int c = pool_class(size);
+    Pool_Slot* s = Pool.free[c];
+    if (!s) {
+        if (Pool.pages_used == Pool.pages) {
+            Pool.fallbacks++;
+            return 0;
+        }
+        // assign a fresh page to this size class
+        size_t page = Pool.pages_used++;
+        Pool.page_class[page] = c;
+        size_t sz = class_size(c);
+        char* base = Pool.start + page * POOL_PAGE;
+        for (size_t off = 0; off + sz <= POOL_PAGE; off += sz) {
+            Pool_Slot* slot = (Pool_Slot*)(base + off);
+            slot->next = Pool.free[c];
+            Pool.free[c] = slot;
+            Pool.slots_free[c]++;
+        }
+        s = Pool.free[c];
+    }
+    Pool.free[c] = s->next;
+    Pool.slots_free[c]--;
+    Pool.slots_used[c]++;
+    return s;
+}
+
+static void pool_free(void* p) {
+    int c = Pool.page_class[page_of(p)];
+    Pool_Slot* s = (Pool_Slot*) p;
+    s->next = Pool.free[c];
+    Pool.free[c] = s;
+    Pool.slots_free[c]++;
+    Pool.slots_used[c]--;
+}
+
+static size_t pool_slot_size(const void* p) {
+    return class_size(Pool.page_class[page_of(p)]);
+}
+
+///////////////////////////////////
+// Owners
+
+#if LUATT_ALLOC_OWNERS
+
+static struct {
+    Luatt_Alloc_Owner table[LUATT_ALLOC_OWNERS];
+    int current;
+    uint32_t clock;
+    uint32_t renames;   // entries named so far, for Luatt_Alloc_Owner_Ref
+} Owners = { { { "other", 0, 0, 0, 0, 0, 0, 0 } }, 0, 0, 0 };
+
+static int get_owner(void* p) {
+    if (in_pool(p)) return Pool.owner[((char*)p - Pool.start) / ALIGN];
+    return (block_from_payload(p)->size & OWNER_MASK) >> OWNER_SHIFT;
+}
+
+static void set_owner(void* p, int id) {
+    if (in_pool(p)) {
+        Pool.owner[((char*)p - Pool.start) / ALIGN] = id;
+    }
+    else {
+        Tlsf_Block* b = block_from_payload(p);
+        b->size = (b->size & ~OWNER_MASK) | ((size_t)id << OWNER_SHIFT);
+    }
+}
+
+int Luatt_Alloc_Owner_Id(const char* name) {
+    const size_t max = sizeof(Owners.table[0].name) - 1;
+    int spare = 0;
+    for (int i = 1; i < LUATT_ALLOC_OWNERS; i++) {
+        Luatt_Alloc_Owner* o = &Owners.table[i];
+        if (o->name[0] && !strncmp(o->name, name, max)) return i;
+        if (i == Owners.current || o->live || o->limit) continue;
+
+        // prefer empty entries, then the least recently used
+        Luatt_Alloc_Owner* best = &Owners.table[spare];
+        if (!spare) spare = i;
+        else if (!o->name[0]) {
+            if (best->name[0]) spare = i;
+        }
+        else if (best->name[0] && o->last_used < best->last_used) spare = i;
+    }
+    if (spare) {
+        Luatt_Alloc_Owner* o = &Owners.table[spare];
+        memset(o, 0, sizeof(*o));
+        strncpy(o->name, name, max);
+        o->last_used = Owners.clock;
+        Owners.renames++;
+    }
+    return spare;
+}
+
+int Luatt_Alloc_Owner_Ref_Id(Luatt_Alloc_Owner_Ref* ref, const char* name) {
+    if (ref->gen != Owners.renames + 1) {
+        ref->id = Luatt_Alloc_Owner_Id(name);
+        ref->gen = Owners.renames + 1;
+    }
+    return ref->id;
+}
+
+void Luatt_Alloc_Set_Owner(int id) {
+    if (id < 0 || id >= LUATT_ALLOC_OWNERS) id = 0;
+    Owners.current = id;
+    Owners.table[id].last_used = ++Owners.clock;
+}
+
+int Luatt_Alloc_Get_Owner() {
+    return Owners.current;
+}
+
+void Luatt_Alloc_Set_Limit(int id, size_t limit) {
+    if (id > 0 && id < LUATT_ALLOC_OWNERS) Owners.table[id].limit = limit;
+}
+
+const Luatt_Alloc_Owner* Luatt_Alloc_Get_Owners(int* n) {
+    *n = LUATT_ALLOC_OWNERS;
+    return Owners.table;
+}
+
+#else
+
+int Luatt_Alloc_Owner_Id(const char* name) { return 0; }
+int Luatt_Alloc_Owner_Ref_Id(Luatt_Alloc_Owner_Ref* ref, const char* name) { return 0; }
+void Luatt_Alloc_Set_Owner(int id) {}
+int Luatt_Alloc_Get_Owner() { return 0; }
+void Luatt_Alloc_Set_Limit(int id, size_t limit) {}
+
+const Luatt_Alloc_Owner* Luatt_Alloc_Get_Owners(int* n) {
+    *n = 0;
+    return 0;
+}
+
+#endif
+
+///////////////////////////////////
+// lua_Alloc
+
+static void* heap_malloc(size_t size) {
+    if (size <= POOL_MAX) {
+        void* p = pool_malloc(size);
+        if (p) return p;
+    }
+    return tlsf_malloc(size);
+}
+
+static void heap_free(void* p) {
+    if (in_pool(p)) pool_free(p);
+    else tlsf_free(p);
+}
+
+// Never fails when shrinking.
+static void* heap_realloc(void* p, size_t osize, size_t nsize) {
+    if (in_pool(p)) {
+        size_t slot = pool_slot_size(p);
+        if (nsize <= slot && pool_class(nsize) == pool_class(slot)) {
+            return p;
+        }
+    }
+    else if (nsize > POOL_MAX || nsize > osize) {
+        if (tlsf_resize(p, nsize)) return p;
+    }
+
+    void* q = heap_malloc(nsize);
+    if (!q) {
+        // shrinking, keep the bigger block
+        if (nsize <= osize) return p;
+        return 0;
+    }
+    memcpy(q, p, osize < nsize ? osize : nsize);
+    heap_free(p);
+    return q;
+}
+
+bool Luatt_Alloc_Begin(void* arena, size_t size, size_t pool_size) {
+    char* mem = (char*) arena;
+    char* aligned = (char*) align_up((uintptr_t) mem);
+    size -= aligned - mem;
+    mem = aligned;
+
+    memset(&Pool, 0, sizeof(Pool));
+    size_t pages = pool_size / POOL_PAGE;
+    size_t meta = align_up(pages);
+#if LUATT_ALLOC_OWNERS
+    meta += pages * (POOL_PAGE / ALIGN);
+#endif
+    if (pages > 0 && meta + pages * POOL_PAGE < size) {
+        Pool.page_class = (uint8_t*) mem;
+        memset(Pool.page_class, PAGE_UNUSED, pages);
+#if LUATT_ALLOC_OWNERS
+        Pool.owner = (uint8_t*) mem + align_up(pages);
+#endif
+        mem += meta;
+        Pool.start = mem;
+        Pool.pages = pages;
+        mem += pages * POOL_PAGE;
+        Pool.end = mem;
+        size -= meta + pages * POOL_PAGE;
+    }
+    return tlsf_begin(mem, size);
+}
+
+// Lua asks for a refused block once more after its emergency GC, unless
+// it can't collect right now. Only then is the request a failure.
+static void refuse(Luatt_Heap* heap, bool retry, void* ptr, size_t osize, size_t nsize) {
+    if (retry) {
+        heap->failures++;
+        return;
+    }
+    heap->refused = true;
+    heap->refused_ptr = ptr;
+    heap->refused_osize = osize;
+    heap->refused_nsize = nsize;
+}
+
+void Luatt_Alloc_Settle(Luatt_Heap* heap) {
+    if (!heap->refused) return;
+    heap->refused = false;
+    heap->failures++;
+}
+
+void* Luatt_Alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    Luatt_Heap* heap = (Luatt_Heap*) ud;
+    size_t lua_osize = osize;
+    bool retry = false;
+    if (nsize && heap->refused) {
+        retry = ptr == heap->refused_ptr && osize == heap->refused_osize &&
+                nsize == heap->refused_nsize;
+        if (!retry) Luatt_Alloc_Settle(heap);
+        heap->refused = false;
+    }
+    if (!ptr) osize = 0; // osize is the Lua type of a new object
+
+#if LUATT_ALLOC_OWNERS
+    int id = ptr ? get_owner(ptr) : Owners.current;
+    Luatt_Alloc_Owner* owner = &Owners.table[id];
+#endif
+
+    if (nsize == 0) {
+        if (ptr) {
+            heap_free(ptr);
+            heap->in_use -= osize;
+            heap->frees++;
+#if LUATT_ALLOC_OWNERS
+            owner->live -= osize;
+            owner->frees++;
+#endif
+        }
+        return 0;
+    }
+
+#if LUATT_ALLOC_OWNERS
+    if (owner->limit && nsize > osize && owner->live + nsize - osize > owner->limit) {
+        owner->failures++;
+        refuse(heap, retry, ptr, lua_osize, nsize);
+        return 0;
+    }
+#endif
+
+    if (heap->ceiling && nsize > osize && heap->in_use + nsize - osize > heap->ceiling) {
+        heap->ceiling_hits++;
+        refuse(heap, retry, ptr, lua_osize, nsize);
+        return 0;
+    }
+
+    void* p = ptr ? heap_realloc(ptr, osize, nsize) : heap_malloc(nsize);
+    if (!p) {
+        refuse(heap, retry, ptr, lua_osize, nsize);
+        return 0;
+    }
+    if (retry) heap->retries++;
+    if (!ptr) heap->allocs++;
+    heap->in_use += nsize;
+    heap->in_use -= osize;
+    if (heap->in_use > heap->peak) heap->peak = heap->in_use;
+    if (heap->pressure_at && heap->in_use > heap->pressure_at) heap->pressure = true;
+
+#if LUATT_ALLOC_OWNERS
+    if (p != ptr) set_owner(p, id);
+    if (!ptr) owner->allocs++;
+    owner->live += nsize;
+    owner->live -= osize;
+    if (owner->live > owner->peak) owner->peak = owner->live;
+#endif
+    return p;
+}
+
+void Luatt_Alloc_Get_Stats(Luatt_Alloc_Stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    stats->pool_size = Pool.pages * POOL_PAGE;
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        stats->pool_used += Pool.slots_used[c] * class_size(c);
+        stats->pool_free += Pool.slots_free[c] * class_size(c);
+    }
+    stats->pool_pages_free = Pool.pages - Pool.pages_used;
+    stats->pool_fallbacks = Pool.fallbacks;
+
+    stats->tlsf_size = Tlsf.size;
+    stats->tlsf_used = Tlsf.used;
+    if (Tlsf.start) {
+        Tlsf_Block* b = (Tlsf_Block*) Tlsf.start;
+        while (block_size(b) > 0) {
+            if (block_is_free(b)) {
+                size_t sz = block_size(b);
+                stats->tlsf_free += sz;
+                if (sz > stats->tlsf_largest_free) stats->tlsf_largest_free = sz;
+                stats->tlsf_free_blocks++;
+            }
+            b = block_next(b);
+        }
+    }
+    stats->arena_size = stats->pool_size + Pool.pages + stats->tlsf_size;
+}
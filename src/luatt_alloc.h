@@ -0,0 +1,117 @@
+#ifndef LUATT_ALLOC_H
+#define LUATT_ALLOC_H
+
+// Lua allocator.
+//
+// All Lua states share one arena, carved into two regions:
+// - Pools: 256 byte pages split into fixed size slots (8 to 64 bytes)
+//   for Lua's small objects: short strings, closures, upvalues, tables.
+// - TLSF: two-level segregated fit allocator for everything else.
+//   Bounded O(1) malloc and free, immediate coalescing.
+//
+// Doesn't use any Arduino APIs, so it builds on the host too.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of owners memory can be charged to, 0 disables attribution.
+// Costs one tag byte per 8 bytes of pool.
+#ifndef LUATT_ALLOC_OWNERS
+#define LUATT_ALLOC_OWNERS 16
+#endif
+
+// Per lua_State accounting, passed as the lua_Alloc userdata.
+struct Luatt_Heap {
+    size_t in_use;      // bytes, as Lua counts them
+    size_t peak;
+    uint32_t allocs;    // new blocks
+    uint32_t frees;
+    // Allocations past the ceiling fail. Lua then runs an emergency
+    // full GC and retries before raising a memory error. 0 for none.
+    size_t ceiling;
+    uint32_t ceiling_hits;
+    uint32_t retries;   // refused, then served after the emergency GC
+    uint32_t failures;  // refused even after it, Lua raised an error
+
+    // The last refused request, until Lua asks again or moves on.
+    bool refused;
+    const void* refused_ptr;
+    size_t refused_osize;
+    size_t refused_nsize;
+
+    // Set when in_use passes pressure_at, so the owner of the state
+    // can collect and evict caches at a safe point.
+    size_t pressure_at;
+    bool pressure;
+    uint32_t pressure_events;
+    uint32_t failures_reported;
+};
+
+struct Luatt_Alloc_Stats {
+    size_t arena_size;
+
+    size_t pool_size;
+    size_t pool_used;       // bytes in slots handed out
+    size_t pool_free;       // bytes in free slots of assigned pages
+    size_t pool_pages_free; // pages not assigned to a size class yet
+    uint32_t pool_fallbacks; // small blocks served by TLSF, pool was full
+
+    size_t tlsf_size;
+    size_t tlsf_used;
+    size_t tlsf_free;
+    size_t tlsf_largest_free;
+    uint32_t tlsf_free_blocks;
+};
+
+// Memory charged to an owner: a scheduler task, a module being loaded,
+// eval, etc. Blocks stay charged to the owner that allocated them, even
+// when Lua reallocs them later. Owner 0 is "other".
+struct Luatt_Alloc_Owner {
+    char name[40];
+    size_t live;        // bytes
+    size_t peak;
+    uint32_t allocs;
+    uint32_t frees;
+    size_t limit;       // 0 for none
+    uint32_t failures;  // allocations refused because of the limit
+    uint32_t last_used;
+};
+
+// Set up the arena. Returns false if it's too small to use.
+bool Luatt_Alloc_Begin(void* arena, size_t size, size_t pool_size);
+
+// lua_Alloc compatible, ud is a Luatt_Heap*.
+void* Luatt_Alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+// Count a refused request Lua hasn't asked for again as a failure. Call
+// between allocations, before reading heap->failures.
+void Luatt_Alloc_Settle(Luatt_Heap* heap);
+
+// Find or add an owner by name. Returns 0 if the table is full and
+// no unused entry can be recycled.
+int Luatt_Alloc_Owner_Id(const char* name);
+
+// An owner id kept by the caller, so switching to it doesn't search the
+// table by name. It's looked up again after entries have been renamed.
+struct Luatt_Alloc_Owner_Ref {
+    int id;
+    uint32_t gen;   // 0 until looked up
+};
+
+int Luatt_Alloc_Owner_Ref_Id(Luatt_Alloc_Owner_Ref* ref, const char* name);
+
+// Charge following allocations to owner id.
+void Luatt_Alloc_Set_Owner(int id);
+int Luatt_Alloc_Get_Owner();
+
+// Allocations that would take the owner past limit bytes fail, and
+// Lua raises a memory error in whatever code is running for it.
+void Luatt_Alloc_Set_Limit(int id, size_t limit);
+
+// Returns the owner table, *n set to the number of entries.
+const Luatt_Alloc_Owner* Luatt_Alloc_Get_Owners(int* n);
+
+// Walks the TLSF region, not for use in hot paths.
+void Luatt_Alloc_Get_Stats(Luatt_Alloc_Stats* stats);
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef LUATT_BIND_H
+#define LUATT_BIND_H
+
+// Generate lua_CFunction wrappers for C++ functions at compile time.
+//
+//   LUATT_FUNC(&f)         free function, every argument from Lua
+//   LUATT_METHOD(&C::m)    member function of the object in upvalue 1,
+//                          a light userdata
+//   LUATT_METHOD(&f)       free function f(C* obj, ...), same upvalue
+//
+// Arguments are converted with luaL_check*() by their C++ type, the
+// result is pushed the same way, void returns nothing. Wrap an argument
+// type in luatt::Opt<T, default> to make it optional. Overloaded
+// functions need a helper with one signature. The upvalue isn't
+// checked, so only use LUATT_METHOD in tables registered like:
+//
+//   static constexpr luaL_Reg led_table[] = {
+//       { "show", LUATT_METHOD(&Adafruit_DotStar::show) },
+//       { 0, 0 }
+//   };
+//   lua_pushlightuserdata(L, dotstar);
+//   luaL_setfuncs(L, led_table, 1);
+//
+// C++11, no standard library.
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
+
+#define LUATT_FUNC(f) (&luatt::Func<decltype(f), f>::call)
+#define LUATT_METHOD(m) (&luatt::Method<decltype(m), m>::call)
+
+namespace luatt {
+
+// Optional argument: def when it's missing or not a number.
+template<typename T, T def>
+struct Opt {
+    T v;
+    operator T() const { return v; }
+};
+
+template<typename T> struct Arg;
+
+#define LUATT_BIND_INTEGER(T) \
+    template<> struct Arg<T> { \
+        static T get(lua_State* L, int i) { return (T) luaL_checkinteger(L, i); } \
+        static void push(lua_State* L, T x) { lua_pushinteger(L, (lua_Integer) x); } \
+    };
+LUATT_BIND_INTEGER(signed char)
+LUATT_BIND_INTEGER(unsigned char)
+LUATT_BIND_INTEGER(short)
+LUATT_BIND_INTEGER(unsigned short)
+LUATT_BIND_INTEGER(int)
+LUATT_BIND_INTEGER(unsigned int)
+LUATT_BIND_INTEGER(long)
+LUATT_BIND_INTEGER(unsigned long)
+LUATT_BIND_INTEGER(long long)
+LUATT_BIND_INTEGER(unsigned long long)
+#undef LUATT_BIND_INTEGER
+
+#define LUATT_BIND_NUMBER(T) \
+    template<> struct Arg<T> { \
+        static T get(lua_State* L, int i) { return (T) luaL_checknumber(L, i); } \
+        static void push(lua_State* L, T x) { lua_pushnumber(L, (lua_Number) x); } \
+    };
+LUATT_BIND_NUMBER(float)
+LUATT_BIND_NUMBER(double)
+#undef LUATT_BIND_NUMBER
+
+template<> struct Arg<bool> {
+    static bool get(lua_State* L, int i) { return lua_toboolean(L, i); }
+    static void push(lua_State* L, bool x) { lua_pushboolean(L, x); }
+};
+
+template<> struct Arg<const char*> {
+    static const char* get(lua_State* L, int i) { return luaL_checkstring(L, i); }
+    static void push(lua_State* L, const char* x) { lua_pushstring(L, x); }
+};
+
+template<typename T, T def> struct Arg<Opt<T, def> > {
+    static Opt<T, def> get(lua_State* L, int i) {
+        int ok;
+        lua_Integer x = lua_tointegerx(L, i, &ok);
+        Opt<T, def> o = { ok ? (T) x : def };
+        return o;
+    }
+};
+
+// Argument indices 1..n as a pack.
+template<int... I> struct Seq {};
+template<int N, int... I> struct Make_Seq : Make_Seq<N - 1, N, I...> {};
+template<int... I> struct Make_Seq<0, I...> { typedef Seq<I...> type; };
+
+// Call fn() and push what it returns.
+template<typename R> struct Ret {
+    template<typename Fn> static int call(lua_State* L, const Fn& fn) {
+        Arg<R>::push(L, fn());
+        return 1;
+    }
+};
+
+template<> struct Ret<void> {
+    template<typename Fn> static int call(lua_State*, const Fn& fn) {
+        fn();
+        return 0;
+    }
+};
+
+template<typename C>
+inline C* self(lua_State* L) {
+    return (C*) lua_touserdata(L, lua_upvalueindex(1));
+}
+
+template<typename F, F f> struct Func;
+
+template<typename R, typename... A, R (*f)(A...)>
+struct Func<R (*)(A...), f> {
+    template<int... I> static int run(lua_State* L, Seq<I...>) {
+        return Ret<R>::call(L, [L]() { return f(Arg<A>::get(L, I)...); });
+    }
+    static int call(lua_State* L) {
+        return run(L, typename Make_Seq<sizeof...(A)>::type());
+    }
+};
+
+template<typename F, F m> struct Method;
+
+template<typename R, typename C, typename... A, R (C::*m)(A...)>
+struct Method<R (C::*)(A...), m> {
+    template<int... I> static int run(lua_State* L, Seq<I...>) {
+        C* obj = self<C>(L);
+        return Ret<R>::call(L, [L, obj]() { return (obj->*m)(Arg<A>::get(L, I)...); });
+    }
+    static int call(lua_State* L) {
+        return run(L, typename Make_Seq<sizeof...(A)>::type());
+    }
+};
+
+template<typename R, typename C, typename... A, R (C::*m)(A...) const>
+struct Method<R (C::*)(A...) const, m> {
+    template<int... I> static int run(lua_State* L, Seq<I...>) {
+        const C* obj = self<C>(L);
+        return Ret<R>::call(L, [L, obj]() { return (obj->*m)(Arg<A>::get(L, I)...); });
+    }
+    static int call(lua_State* L) {
+        return run(L, typename Make_Seq<sizeof...(A)>::type());
+    }
+};
+
+template<typename R, typename C, typename... A, R (*f)(C*, A...)>
+struct Method<R (*)(C*, A...), f> {
+    template<int... I> static int run(lua_State* L, Seq<I...>) {
+        C* obj = self<C>(L);
+        return Ret<R>::call(L, [L, obj]() { return f(obj, Arg<A>::get(L, I)...); });
+    }
+    static int call(lua_State* L) {
+        return run(L, typename Make_Seq<sizeof...(A)>::type());
+    }
+};
+
+}
+
+#endif
@@ -2,38 +2,437 @@
 #include "Adafruit_TinyUSB.h"
 
 #include "luatt_context.h"
+#include "luatt_output.h"
 #include "luatt_funcs.h"
+#include "luatt_log.h"
+#include "luatt_prof.h"
 
 struct lua_State* LUA = 0;
 
+// Named Lua states, each with its own scheduler. States[0] is "main"
+// and is also LUA.
+struct Lua_Slot {
+    char name[LUATT_STATE_NAME_MAX];
+    lua_State* L;
+    size_t heap_ceiling;    // 0 for Luatt_Config::heap_ceiling
+    int priority;           // 0 is critical, higher is best effort
+    uint32_t wake_us;       // micros() when its scheduler wants to run
+    bool timed;             // wake_us is a sleep the scheduler asked for
+    uint32_t irq_flags;     // interrupt flags it hasn't seen yet
+    Luatt_Alloc_Owner_Ref owner;
+};
+
+static Lua_Slot States[LUATT_MAX_STATES] = { { "main", 0, 0, 0, 0, false, 0, { 0, 0 } } };
+
+// State loader commands go to, see Lua_Select().
+static int Selected;
+
+// Where the search for the next best effort state starts.
+static int Next_rr;
+
+static uint32_t Loop_calls;
+
+static struct {
+    lua_State* L;
+    int slot;       // States[] entry it will replace
+    bool failed;
+} Staged;
+
 static luatt_setup_callback State_setup_cb;
 
-void Lua_Begin(luatt_setup_callback setup_cb) {
+static const char* const Default_core_pkgs[] = {
+    "PriorityQueue", "scheduler", "MQ", 0
+};
+
+static Luatt_Config State_config;
+
+static void* Heap_arena;
+static size_t Heap_size;
+
+void Lua_Begin(luatt_setup_callback setup_cb, const Luatt_Config* config) {
     State_setup_cb = setup_cb;
+    if (config) State_config = *config;
 }
 
-void Lua_Reset() {
-    if (LUA) {
-        lua_close(LUA);
+const char* const Luatt_Callback_Names[LUATT_CB_COUNT] = {
+    "sched_loop", "on_msg", "spawn", "low_mem"
+};
+
+const char* const Luatt_Reset_Phase_Names[LUATT_RESET_PHASES] = {
+    "close", "state", "libs", "luatt", "setup", "snapshot"
+};
+
+// Push a shallow copy of the table at idx.
+static void copy_table(lua_State* L, int idx) {
+    idx = lua_absindex(L, idx);
+
+    // presize it, instead of rehashing as it fills
+    int n = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pop(L, 1);
+        n++;
+    }
+    lua_createtable(L, 0, n);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);
     }
-    LUA = luaL_newstate();
+}
 
-    lua_State* L = LUA;
-    luaL_openlibs(L);
+// Make table at idx match the copy on top of the stack, then pop the copy.
+static void restore_table(lua_State* L, int idx) {
+    idx = lua_absindex(L, idx);
+    int copy = lua_gettop(L);
 
-    // global Luatt table
-    lua_newtable(L);
+    // remove keys that weren't there
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        if (lua_rawget(L, copy) == LUA_TNIL) {
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_rawset(L, idx);
+        }
+        lua_pop(L, 1);
+    }
+
+    // put back original values
+    lua_pushnil(L);
+    while (lua_next(L, copy)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, idx);
+    }
+    lua_pop(L, 1);
+}
+
+static const char* const* core_pkgs() {
+    if (State_config.core_pkgs) return State_config.core_pkgs;
+    return Default_core_pkgs;
+}
+
+static bool is_core_pkg(const char* name) {
+    for (const char* const* p = core_pkgs(); *p; p++) {
+        if (!strcmp(*p, name)) return true;
+    }
+    return false;
+}
+
+static void heap_begin() {
+    size_t size = State_config.heap_size;
+    if (!size) size = LUATT_HEAP_SIZE;
+    size_t pool_size = State_config.pool_size;
+    if (!pool_size) pool_size = size / 4;
+
+    Heap_arena = malloc(size);
+    if (!Heap_arena) {
+        Luatt_Out.printf(LUATT_ERROR "malloc(%i) failed, using libc heap.\n", (int)size);
+        return;
+    }
+    if (!Luatt_Alloc_Begin(Heap_arena, size, pool_size)) {
+        free(Heap_arena);
+        Heap_arena = 0;
+        return;
+    }
+    Heap_size = size;
+}
+
+static int lua_panic(lua_State* L) {
+    const char* err_str = lua_tostring(L, -1);
+    Luatt_Out.printf(LUATT_ERROR "PANIC,%s\n", err_str ? err_str : "?");
+    return 0; // abort
+}
+
+Luatt_Context* Lua_Context(lua_State* L) {
+    return *(Luatt_Context**) lua_getextraspace(L);
+}
+
+Luatt_Heap* Lua_Heap(lua_State* L) {
+    if (lua_getallocf(L, 0) != Luatt_Alloc) return 0;
+    return &Lua_Context(L)->heap;
+}
+
+void Lua_Set_Callback(lua_State* L, int cb, int idx) {
+    Luatt_Context* ctx = Lua_Context(L);
+    luaL_unref(L, LUA_REGISTRYINDEX, ctx->cb_ref[cb]);
+    lua_pushvalue(L, idx);
+    ctx->cb_ref[cb] = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+int Lua_Call_Callback(lua_State* L, int cb, int nargs, int nresults) {
+    Luatt_Context* ctx = Lua_Context(L);
+    if (ctx->cb_ref[cb] < 0) {
+        lua_pop(L, nargs);
+        return LUATT_NO_CALLBACK;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->cb_ref[cb]);
+    lua_insert(L, -(nargs + 1));
+
+    uint32_t start = micros();
+    int r = lua_pcall(L, nargs, nresults, 0);
+    uint32_t us = micros() - start;
+
+    Luatt_Callback_Stats* st = &ctx->cb_stats[cb];
+    st->calls++;
+    st->total_us += us;
+    if (us > st->max_us) st->max_us = us;
+    if (r != LUA_OK) st->errors++;
+    return r;
+}
+
+// Count hook, checks the execution budget and takes profiler samples.
+static void budget_hook(lua_State* L, lua_Debug* ar) {
+    Luatt_Context* ctx = Lua_Context(L);
+    if (Luatt_Prof_Active) Luatt_Prof_Sample(L);
+    if (!ctx->budget.us || micros() - ctx->budget.start < ctx->budget.us) return;
+    ctx->budget.overrun = true;
+    if (L == ctx->budget.thread && lua_isyieldable(L)) {
+        // back to the scheduler, resumes where it left off
+        lua_yield(L, 0);
+        return;
+    }
+    luaL_error(L, "execution budget exceeded");
+}
+
+void Lua_Budget_Begin(lua_State* L, uint32_t us) {
+    Luatt_Context* ctx = Lua_Context(L);
+    ctx->budget.start = micros();
+    ctx->budget.us = us;
+    ctx->budget.thread = 0;
+    ctx->budget.overrun = false;
+}
+
+bool Lua_Budget_End(lua_State* L) {
+    Luatt_Context* ctx = Lua_Context(L);
+    bool overrun = ctx->budget.overrun;
+    ctx->budget.us = 0;
+    ctx->budget.overrun = false;
+    if (overrun) ctx->overruns++;
+    return overrun;
+}
+
+void Lua_Set_Owner(const char* name) {
+    Luatt_Alloc_Set_Owner(Luatt_Alloc_Owner_Id(name));
+}
+
+static void Lua_Close(lua_State* L) {
+    Luatt_Context* ctx = Lua_Context(L);
+    ctx->closing = true;
+    // task line buffers are keyed by coroutines about to be freed
+    Luatt_Out.flush_lines(0);
+    lua_close(L);
+    free(ctx);
+}
+
+static void gc_sentinel(lua_State* L);
+
+// The sentinel is garbage as soon as it's made, so its finalizer runs
+// once per collection. It replaces itself for the next one.
+static int gc_sentinel_gc(lua_State* L) {
+    Luatt_Context* ctx = Lua_Context(L);
+    ctx->gc_cycles++;
+    if (!ctx->closing) gc_sentinel(L);
+    return 0;
+}
+
+static void gc_sentinel(lua_State* L) {
+    lua_newuserdatauv(L, 0, 0);
+    if (luaL_newmetatable(L, "luatt_gc_sentinel")) {
+        lua_pushcfunction(L, gc_sentinel_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+}
+
+static void gc_setup(lua_State* L) {
+    const Luatt_Config& c = State_config;
+    if (c.gc_mode == LUATT_GC_GENERATIONAL) {
+        lua_gc(L, LUA_GCGEN, c.gc_minormul, c.gc_majormul);
+    }
+    else {
+        lua_gc(L, LUA_GCINC, c.gc_pause, c.gc_stepmul, c.gc_stepsize);
+    }
+}
+
+// Spend part of the sleep Lua_Loop is about to return on GC steps, so
+// collection happens between ticks instead of in the middle of one. On
+// the luatt heap Lua's own collector is stopped and this is the only
+// one. Returns the remaining sleep.
+static int idle_gc(lua_State* L, int sleep_ms) {
+    uint32_t budget = State_config.idle_gc_us;
+    if (!budget || sleep_ms <= 0) return sleep_ms;
+
+    // Don't start a new cycle until the heap has grown by 1/8.
+    Luatt_Context* ctx = Lua_Context(L);
+    int kb = lua_gc(L, LUA_GCCOUNT);
+    if (!ctx->gc_in_cycle && kb < ctx->gc_kb_after + ctx->gc_kb_after / 8) {
+        return sleep_ms;
+    }
+
+    // use at most half the idle time
+    if (budget > (uint32_t)sleep_ms * 500) budget = sleep_ms * 500;
+
+    uint32_t start = micros();
+    if (State_config.gc_mode == LUATT_GC_GENERATIONAL) {
+        // a step is a whole minor collection and never ends a cycle
+        lua_gc(L, LUA_GCSTEP, 0);
+        ctx->gc_in_cycle = false;
+        ctx->gc_kb_after = lua_gc(L, LUA_GCCOUNT);
+    }
+    else {
+        ctx->gc_in_cycle = true;
+        do {
+            if (lua_gc(L, LUA_GCSTEP, 0)) {
+                ctx->gc_in_cycle = false;
+                ctx->gc_kb_after = lua_gc(L, LUA_GCCOUNT);
+                break;
+            }
+        } while (micros() - start < budget);
+    }
+
+    int spent_ms = (micros() - start) / 1000;
+    return sleep_ms > spent_ms ? sleep_ms - spent_ms : 0;
+}
+
+void Lua_Idle_Gc(lua_State* L) {
+    Lua_Context(L)->gc_in_cycle = true;
+}
+
+// Report allocation failures, and handle memory pressure at a point
+// where it's safe to run Lua code.
+static void check_memory(lua_State* L) {
+    Luatt_Heap* heap = Lua_Heap(L);
+    if (!heap) return;
+
+    Luatt_Alloc_Settle(heap);
+    if (heap->failures != heap->failures_reported) {
+        Luatt_Out.printf(LUATT_ERROR "out of memory,%u failures,%u bytes in use,%u ceiling\n",
+            (unsigned)(heap->failures - heap->failures_reported),
+            (unsigned)heap->in_use, (unsigned)heap->ceiling);
+        heap->failures_reported = heap->failures;
+    }
+
+    if (!heap->pressure) return;
+    heap->pressure_events++;
+
+    // Lua function to evict caches
+    int r = Lua_Call_Callback(L, LUATT_CB_LOW_MEM, 0, 0);
+    if (r != LUA_OK && r != LUATT_NO_CALLBACK) {
+        const char* err_str = lua_tostring(L, lua_gettop(L));
+        LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+        lua_pop(L, 1);
+    }
+    lua_gc(L, LUA_GCCOLLECT);
+
+    // Next time when half the remaining headroom is used.
+    size_t base = heap->ceiling - heap->ceiling / 8;
+    size_t next = heap->in_use + (heap->ceiling - heap->in_use) / 2;
+    heap->pressure_at = next > base ? next : base;
+    heap->pressure = false;
+}
+
+static const struct {
+    uint32_t bit;
+    const char* name;
+    lua_CFunction open;
+} Std_libs[] = {
+    { LUATT_LIB_BASE,      LUA_GNAME,       luaopen_base },
+    { LUATT_LIB_PACKAGE,   LUA_LOADLIBNAME, luaopen_package },
+    { LUATT_LIB_COROUTINE, LUA_COLIBNAME,   luaopen_coroutine },
+    { LUATT_LIB_TABLE,     LUA_TABLIBNAME,  luaopen_table },
+    { LUATT_LIB_IO,        LUA_IOLIBNAME,   luaopen_io },
+    { LUATT_LIB_OS,        LUA_OSLIBNAME,   luaopen_os },
+    { LUATT_LIB_STRING,    LUA_STRLIBNAME,  luaopen_string },
+    { LUATT_LIB_MATH,      LUA_MATHLIBNAME, luaopen_math },
+    { LUATT_LIB_UTF8,      LUA_UTF8LIBNAME, luaopen_utf8 },
+    { LUATT_LIB_DEBUG,     LUA_DBLIBNAME,   luaopen_debug },
+};
+
+// Like luaL_openlibs(), but only the ones in Luatt_Config::libs.
+static void open_libs(lua_State* L) {
+    for (size_t i = 0; i < sizeof(Std_libs) / sizeof(Std_libs[0]); i++) {
+        if (State_config.libs & Std_libs[i].bit) {
+            luaL_requiref(L, Std_libs[i].name, Std_libs[i].open, 1);
+            lua_pop(L, 1);
+        }
+    }
+}
+
+static size_t heap_bytes(lua_State* L) {
+    return (size_t)lua_gc(L, LUA_GCCOUNT) * 1024 + lua_gc(L, LUA_GCCOUNTB);
+}
+
+// End of a Lua_New_State() phase, t and bytes are when it started.
+static void reset_phase(lua_State* L, int phase, uint32_t* t, size_t* bytes) {
+    Luatt_Context* ctx = Lua_Context(L);
+    uint32_t now = micros();
+    size_t b = heap_bytes(L);
+    ctx->reset_us[phase] = now - *t;
+    ctx->reset_bytes[phase] = b - *bytes;
+    *t = now;
+    *bytes = b;
+}
+
+static lua_State* Lua_New_State(size_t heap_ceiling) {
+    uint32_t t = micros();
+    if (!Heap_arena) heap_begin();
+
+    Luatt_Context* ctx = (Luatt_Context*) calloc(1, sizeof(Luatt_Context));
+    if (!ctx) return 0;
+    for (int cb = 0; cb < LUATT_CB_COUNT; cb++) {
+        ctx->cb_ref[cb] = LUA_NOREF;
+    }
+    ctx->resume_budget_us = State_config.resume_budget_us;
+    ctx->eval_budget_us = State_config.eval_budget_us;
+
+    lua_State* L;
+    if (Heap_arena) {
+        Luatt_Heap* heap = &ctx->heap;
+        heap->ceiling = heap_ceiling ? heap_ceiling : State_config.heap_ceiling;
+        if (!heap->ceiling || heap->ceiling > Heap_size) heap->ceiling = Heap_size;
+        heap->pressure_at = heap->ceiling - heap->ceiling / 8;
+        L = lua_newstate(Luatt_Alloc, heap);
+        if (L) lua_atpanic(L, lua_panic);
+    }
+    else {
+        L = luaL_newstate();
+    }
+    if (!L) {
+        free(ctx);
+        return 0;
+    }
+    // copied to every thread
+    *(Luatt_Context**) lua_getextraspace(L) = ctx;
+    gc_setup(L);
+    lua_gc(L, LUA_GCSTOP);
+
+    // new threads inherit the hook
+    lua_sethook(L, budget_hook, LUA_MASKCOUNT, LUATT_BUDGET_CHECK);
+
+    size_t bytes = 0;
+    reset_phase(L, LUATT_RESET_STATE, &t, &bytes);
+
+    open_libs(L);
+    reset_phase(L, LUATT_RESET_LIBS, &t, &bytes);
+
+    // global Luatt table: pkgs, periphs, dbg, time
+    lua_createtable(L, 0, 4);
     lua_pushvalue(L, -1);
     lua_setfield(L, LUA_REGISTRYINDEX, "luatt_root");
 
     // Luatt.pkgs
-    lua_newtable(L);
+    lua_createtable(L, 0, State_config.pkgs_size);
     lua_pushvalue(L, -1);
     lua_setfield(L, LUA_REGISTRYINDEX, "luatt_pkgs");
     lua_setfield(L, -2, "pkgs");
 
     // Luatt.periphs
-    lua_newtable(L);
+    lua_createtable(L, 0, State_config.periphs_size);
     lua_pushvalue(L, -1);
     lua_setfield(L, LUA_REGISTRYINDEX, "luatt_periphs");
     lua_setfield(L, -2, "periphs");
@@ -46,37 +445,339 @@ void Lua_Reset() {
 
     lua_setglobal(L, "Luatt");
 
+    // module name -> hash of the loaded source, see Luatt_Loader
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, "luatt_hashes");
+
+    // task token -> budget overruns, see Luatt.resume()
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, "luatt_overruns");
+
     luatt_setfuncs(L);
+    gc_sentinel(L);
+    reset_phase(L, LUATT_RESET_LUATT, &t, &bytes);
 
+    // setup may load code, which makes garbage
+    lua_gc(L, LUA_GCRESTART);
     if (State_setup_cb) State_setup_cb(L);
+    reset_phase(L, LUATT_RESET_SETUP, &t, &bytes);
+
+    // From here on idle_gc() collects, so no collection lands in a tick.
+    // The low memory GC and Lua's emergency GC at the ceiling catch up
+    // if there's never idle time. Without a ceiling, leave it to Lua.
+    if (State_config.idle_gc_us && Lua_Heap(L)) lua_gc(L, LUA_GCSTOP);
+
+    // Snapshot for Lua_Soft_Reset()
+    lua_pushglobaltable(L);
+    copy_table(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "luatt_pristine_G");
+    lua_pop(L, 1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "luatt_root");
+    copy_table(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "luatt_pristine_root");
+    lua_pop(L, 1);
+    reset_phase(L, LUATT_RESET_SNAPSHOT, &t, &bytes);
+
+    return L;
 }
 
-int Lua_Loop(uint32_t interrupt_flags) {
-    int max_sleep = 5000;
-    if (!LUA) return max_sleep;
+static void set_state(Lua_Slot* s, lua_State* L) {
+    s->L = L;
+    s->wake_us = micros();
+    s->timed = false;
+    s->irq_flags = 0;
+    if (s == States) LUA = L;
+}
 
-    Serial.set_mux_token("sched");
+static int find_state(const char* name) {
+    for (int i = 0; i < LUATT_MAX_STATES; i++) {
+        if (States[i].name[0] && !strcmp(States[i].name, name)) return i;
+    }
+    return -1;
+}
 
-    // Lua function scheduler.loop
-    int r = lua_getfield(LUA, LUA_REGISTRYINDEX, "luatt_sched_loop");
-    if (r != LUA_TFUNCTION) {
-        lua_pop(LUA, 1);
-        return max_sleep;
+bool Lua_Add_State(const char* name, size_t heap_ceiling, int priority) {
+    if (!name[0] || strlen(name) >= LUATT_STATE_NAME_MAX) return false;
+    int i = find_state(name);
+    if (i < 0) {
+        // look for a free slot
+        for (i = 1; i < LUATT_MAX_STATES && States[i].name[0]; i++);
+        if (i == LUATT_MAX_STATES) return false;
+    }
+    Lua_Slot* s = &States[i];
+    strcpy(s->name, name);
+    s->owner.gen = 0;
+    s->heap_ceiling = heap_ceiling;
+    s->priority = priority;
+    if (!s->L) {
+        set_state(s, Lua_New_State(heap_ceiling));
+        if (!s->L && i) {
+            s->name[0] = 0;
+            return false;
+        }
+    }
+    return true;
+}
+
+void Lua_Remove_State(const char* name) {
+    int i = find_state(name);
+    if (i <= 0) return; // main stays
+    if (Staged.L && Staged.slot == i) Lua_Stage_Abort();
+    if (States[i].L) Lua_Close(States[i].L);
+    memset(&States[i], 0, sizeof(States[i]));
+    if (Selected == i) Selected = 0;
+}
+
+bool Lua_Select(const char* name) {
+    int i = find_state(name);
+    if (i < 0) return false;
+    Selected = i;
+    return true;
+}
+
+lua_State* Lua_Get_State(int i) {
+    if (i < 0 || i >= LUATT_MAX_STATES) return 0;
+    return States[i].L;
+}
+
+const char* Lua_State_Name(int i) {
+    if (i < 0 || i >= LUATT_MAX_STATES) return "";
+    return States[i].name;
+}
+
+uint32_t Lua_Loop_Calls() {
+    return Loop_calls;
+}
+
+// A staged reset of another state survives this one.
+static void abort_selected_stage() {
+    if (Staged.L && Staged.slot == Selected) Lua_Stage_Abort();
+}
+
+void Lua_Reset() {
+    abort_selected_stage();
+    Lua_Slot* s = &States[Selected];
+    uint32_t t = micros();
+    if (s->L) {
+        Lua_Close(s->L);
+    }
+    t = micros() - t;
+    set_state(s, Lua_New_State(s->heap_ceiling));
+    if (s->L) Lua_Context(s->L)->reset_us[LUATT_RESET_CLOSE] = t;
+}
+
+// Remove non-core package names from the table at idx.
+static void drop_user_pkgs(lua_State* L, int idx) {
+    idx = lua_absindex(L, idx);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) != LUA_TSTRING || !is_core_pkg(lua_tostring(L, -1))) {
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, idx);
+        }
+    }
+}
+
+void Lua_Soft_Reset() {
+    abort_selected_stage();
+    lua_State* L = States[Selected].L;
+    if (!L) {
+        Lua_Reset();
+        return;
+    }
+    lua_settop(L, 0);
+    Luatt_Out.flush_lines(0);
+
+    lua_pushnil(L);
+    for (int cb = 0; cb < LUATT_CB_COUNT; cb++) {
+        Lua_Set_Callback(L, cb, -1);
     }
+    lua_pop(L, 1);
 
-    lua_pushinteger(LUA, interrupt_flags);
+    // drop user packages
+    lua_getfield(L, LUA_REGISTRYINDEX, "luatt_hashes");
+    drop_user_pkgs(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, "luatt_pkgs");
+    drop_user_pkgs(L, -1);
+
+    lua_pushglobaltable(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, "luatt_pristine_G");
+    restore_table(L, -2);
+    lua_pop(L, 1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "luatt_root");
+    lua_getfield(L, LUA_REGISTRYINDEX, "luatt_pristine_root");
+    restore_table(L, -2);
+    lua_pop(L, 1);
+
+    // let core packages reset themselves, in load order
+    for (const char* const* p = core_pkgs(); *p; p++) {
+        if (lua_getfield(L, -1, *p) == LUA_TTABLE &&
+            lua_getfield(L, -1, "reset") == LUA_TFUNCTION)
+        {
+            int r = lua_pcall(L, 0, 0, 0);
+            if (r != LUA_OK) {
+                const char* err_str = lua_tostring(L, lua_gettop(L));
+                LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+            }
+        }
+        lua_settop(L, 1);
+    }
+    lua_pop(L, 1); // luatt_pkgs
+
+    lua_gc(L, LUA_GCCOLLECT);
+}
+
+bool Lua_Stage_Begin() {
+#if LUATT_STAGED_RESET
+    Lua_Stage_Abort();
+    Staged.L = Lua_New_State(States[Selected].heap_ceiling);
+    Staged.slot = Selected;
+    Staged.failed = false;
+    return Staged.L != 0;
+#else
+    return false;
+#endif
+}
+
+void Lua_Stage_Fail() {
+    if (Staged.L) Staged.failed = true;
+}
+
+bool Lua_Stage_Commit() {
+    if (!Staged.L) return false;
+    if (Staged.failed) {
+        // roll back, old app keeps running
+        Lua_Stage_Abort();
+        return false;
+    }
+    Lua_Slot* s = &States[Staged.slot];
+    if (s->L) {
+        Lua_Close(s->L);
+    }
+    set_state(s, Staged.L);
+    Staged.L = 0;
+    return true;
+}
+
+void Lua_Stage_Abort() {
+    if (Staged.L) {
+        Lua_Close(Staged.L);
+        Staged.L = 0;
+    }
+    Staged.failed = false;
+}
 
-    r = lua_pcall(LUA, 1, 1, 0);
+lua_State* Lua_Target() {
+    if (Staged.L && Staged.slot == Selected) return Staged.L;
+    return States[Selected].L;
+}
+
+// Run one state's scheduler tick.
+static void run_state(int i) {
+    const uint32_t max_sleep_us = 5000000;
+    Lua_Slot* s = &States[i];
+    lua_State* L = s->L;
+    Luatt_Context* ctx = Lua_Context(L);
+    uint32_t flags = s->irq_flags;
+    s->irq_flags = 0;
+
+    uint32_t start = micros();
+    if (s->timed && (int32_t)(start - s->wake_us) >= 0) {
+        Luatt_Hist_Add(&ctx->late_us, start - s->wake_us);
+    }
+    s->wake_us = start + max_sleep_us;
+    s->timed = false;
+
+    Luatt_Out.set_mux_token(LUATT_OUT_SCHED);
+    Luatt_Alloc_Set_Owner(i ? Luatt_Alloc_Owner_Ref_Id(&s->owner, s->name)
+                            : Luatt_Out.token_owner(LUATT_OUT_SCHED));
+    check_memory(L);
+
+    // Lua function scheduler.loop
+    lua_pushinteger(L, flags);
+    int r = Lua_Call_Callback(L, LUATT_CB_SCHED_LOOP, 1, 1);
+    if (r == LUATT_NO_CALLBACK) {
+        return;
+    }
+    uint32_t end = micros();
+    Luatt_Hist_Add(&ctx->tick_us, end - start);
     if (r != LUA_OK) {
-        const char* err_str = lua_tostring(LUA, lua_gettop(LUA));
-        Serial.printf("error|%s:%i,%i,%s\n", __FILE__, __LINE__, r, err_str);
-        lua_pop(LUA, 1);
-        return max_sleep;
+        const char* err_str = lua_tostring(L, lua_gettop(L));
+        LUATT_LOG(LUATT_ERROR "%s,%i,%s", s->name, r, err_str);
+        lua_pop(L, 1);
+        return;
+    }
+    if (lua_gettop(L) > 0) {
+        int ms = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (ms < 0) ms = 0;
+        if ((uint32_t)ms < max_sleep_us / 1000) {
+            s->wake_us = end + ms * 1000;
+            s->timed = true;
+        }
+    }
+}
+
+void Lua_Wake(lua_State* L) {
+    if (!L) return;
+    Luatt_Context* ctx = Lua_Context(L);
+    for (int i = 0; i < LUATT_MAX_STATES; i++) {
+        Lua_Slot* s = &States[i];
+        if (!s->L || Lua_Context(s->L) != ctx) continue;
+        s->wake_us = micros();
+        s->timed = false;
+        return;
+    }
+}
+
+static bool state_due(const Lua_Slot* s, uint32_t now) {
+    return s->irq_flags || (int32_t)(now - s->wake_us) >= 0;
+}
+
+// Every due critical (priority 0) state runs each call. Of the due best
+// effort states only one runs, the lowest priority number, round robin
+// between equals, so a slow best effort tick delays the critical states
+// by one tick at most.
+int Lua_Loop(uint32_t interrupt_flags) {
+    int sleep_ms = 5000;
+    uint32_t now = micros();
+    Loop_calls++;
+
+    int best = -1;
+    for (int k = 0; k < LUATT_MAX_STATES; k++) {
+        int i = (Next_rr + k) % LUATT_MAX_STATES;
+        Lua_Slot* s = &States[i];
+        if (!s->L) continue;
+        s->irq_flags |= interrupt_flags;
+        if (!state_due(s, now)) continue;
+        if (s->priority <= 0) {
+            run_state(i);
+        }
+        else if (best < 0 || s->priority < States[best].priority) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        run_state(best);
+        Next_rr = best + 1;
+    }
+
+    // sleep until the next state is due
+    now = micros();
+    for (int i = 0; i < LUATT_MAX_STATES; i++) {
+        Lua_Slot* s = &States[i];
+        if (!s->L) continue;
+        // round up, waking early just means another pass
+        int ms = state_due(s, now) ? 0 : (int)(s->wake_us - now + 999) / 1000;
+        if (ms < sleep_ms) sleep_ms = ms;
     }
-    if (lua_gettop(LUA) > 0) {
-        uint32_t ms = lua_tointeger(LUA, -1);
-        lua_pop(LUA, 1);
-        return ms;
+    for (int i = 0; i < LUATT_MAX_STATES; i++) {
+        if (States[i].L) sleep_ms = idle_gc(States[i].L, sleep_ms);
     }
-    return max_sleep;
+    return sleep_ms;
 }
@@ -7,12 +7,262 @@ extern "C" {
 #include <lauxlib.h>
 }
 
+#include "luatt_alloc.h"
+#include "luatt_hist.h"
+
+// Build a second Lua state alongside the running one during a redeploy.
+// Needs RAM for two copies of the app, set to 0 on small boards.
+#ifndef LUATT_STAGED_RESET
+#define LUATT_STAGED_RESET 1
+#endif
+
+// Bytes for the Lua heap arena, shared by all Lua states.
+#ifndef LUATT_HEAP_SIZE
+#if defined(ARDUINO_RASPBERRY_PI_PICO)
+#define LUATT_HEAP_SIZE (128 * 1024)
+#elif defined(ARDUINO_NRF52840_ITSYBITSY)
+#define LUATT_HEAP_SIZE (96 * 1024)
+#else
+#define LUATT_HEAP_SIZE (64 * 1024)
+#endif
+#endif
+
+// Most Lua states Lua_Loop schedules, including "main".
+#ifndef LUATT_MAX_STATES
+#define LUATT_MAX_STATES 4
+#endif
+#define LUATT_STATE_NAME_MAX 16
+
+// Lua VM instructions between checks of the execution budget.
+#ifndef LUATT_BUDGET_CHECK
+#define LUATT_BUDGET_CHECK 1000
+#endif
+
+// The "main" state.
 extern struct lua_State* LUA;
 
+enum {
+    LUATT_GC_INCREMENTAL,
+    LUATT_GC_GENERATIONAL,
+};
+
+// Standard libraries for Luatt_Config::libs.
+enum {
+    LUATT_LIB_BASE      = 1 << 0,
+    LUATT_LIB_PACKAGE   = 1 << 1,
+    LUATT_LIB_COROUTINE = 1 << 2,
+    LUATT_LIB_TABLE     = 1 << 3,
+    LUATT_LIB_IO        = 1 << 4,
+    LUATT_LIB_OS        = 1 << 5,
+    LUATT_LIB_STRING    = 1 << 6,
+    LUATT_LIB_MATH      = 1 << 7,
+    LUATT_LIB_UTF8      = 1 << 8,
+    LUATT_LIB_DEBUG     = 1 << 9,
+    LUATT_LIBS_ALL      = (1 << 10) - 1,
+
+    // Enough for Luatt's own Lua code, no io, os, debug or require.
+    LUATT_LIBS_LEAN     = LUATT_LIBS_ALL & ~(LUATT_LIB_PACKAGE | LUATT_LIB_IO |
+                                             LUATT_LIB_OS | LUATT_LIB_DEBUG),
+};
+
+// Optional settings for Lua_Begin(). Zero/null fields use the defaults.
+struct Luatt_Config {
+    // Luatt.pkgs entries kept by Lua_Soft_Reset(), null terminated.
+    // Default is PriorityQueue, scheduler and MQ.
+    const char* const* core_pkgs = 0;
+
+    // LUATT_LIB_* bits, the standard libraries each state opens.
+    uint32_t libs = LUATT_LIBS_ALL;
+
+    // Hash slots to preallocate in Luatt.pkgs and Luatt.periphs, saves
+    // rehashing them as the app loads.
+    int pkgs_size = 0;
+    int periphs_size = 0;
+
+    // Lua heap arena size, default LUATT_HEAP_SIZE. If it can't be
+    // allocated, Lua falls back to the libc heap.
+    size_t heap_size = 0;
+
+    // Part of the arena for small block pools, default 1/4.
+    size_t pool_size = 0;
+
+    // Most heap bytes one Lua state may use, default the whole arena.
+    // Past 7/8 of it, Lua_Loop runs the low memory callback and a full
+    // GC. At the ceiling allocations fail with a Lua memory error.
+    // When running several states, set it or give each state its own
+    // with Lua_Add_State().
+    size_t heap_ceiling = 0;
+
+    // Collector setup, see lua_gc(). Zero keeps Lua's default. The
+    // collector is stopped while the state is built, up to the setup
+    // callback, since nothing it makes is garbage.
+    int gc_mode = LUATT_GC_INCREMENTAL;
+    int gc_pause = 0;       // incremental, percent
+    int gc_stepmul = 0;     // incremental
+    int gc_stepsize = 0;    // incremental, log2 bytes
+    int gc_minormul = 0;    // generational, percent
+    int gc_majormul = 0;    // generational, percent
+
+    // Lua_Loop spends up to this many microseconds of the sleep it's
+    // about to return doing incremental GC steps. In generational mode
+    // it does one minor collection instead. On the luatt heap Lua's own
+    // collector is then stopped, so none of it runs inside a tick; a
+    // state that's never idle is collected at 7/8 of its ceiling.
+    // 0 leaves collection to Lua.
+    uint32_t idle_gc_us = 1000;
+
+    // Execution budgets, microseconds, 0 for none. A scheduler thread
+    // that runs past resume_budget_us without yielding is preempted:
+    // made to yield where Lua allows it, otherwise it gets a "budget
+    // exceeded" error. An eval past eval_budget_us gets the error.
+    uint32_t resume_budget_us = 20000;
+    uint32_t eval_budget_us = 5000000;
+};
+
 typedef void (*luatt_setup_callback)(struct lua_State*);
-void Lua_Begin(luatt_setup_callback setup_cb);
+void Lua_Begin(luatt_setup_callback setup_cb, const Luatt_Config* config=0);
+
+// Add a Lua state with its own globals, scheduler and heap ceiling
+// (0 for the Luatt_Config one) in the shared arena. Priority 0 states
+// are critical and run whenever they're due. Higher numbers are best
+// effort: Lua_Loop runs at most one of them per call. Calling it again
+// with the same name updates the ceiling and priority, the ceiling
+// taking effect on the next reset.
+bool Lua_Add_State(const char* name, size_t heap_ceiling=0, int priority=0);
+void Lua_Remove_State(const char* name);
+
+// Choose the state that Lua_Reset(), Lua_Soft_Reset(), the stage
+// functions and Lua_Target() work on. Returns false if there's no
+// state by that name. Default is "main".
+bool Lua_Select(const char* name);
+
+// State in slot i, or null. For visiting every state.
+struct lua_State* Lua_Get_State(int i);
+const char* Lua_State_Name(int i);
 
+// Rebuild the selected state.
 void Lua_Reset();
+
+// Fast reset that keeps the Lua state. Drops every Luatt.pkgs entry
+// except the core packages, restores globals and the Luatt table to how
+// they were after setup, clears the callbacks and runs a full GC. Core
+// packages with a reset() function get it called so they can clear
+// their own state and re-register callbacks.
+void Lua_Soft_Reset();
+
 int Lua_Loop(uint32_t interrupt_flags);
+uint32_t Lua_Loop_Calls();
+
+// Make L's state due on the next Lua_Loop, for work that arrived while
+// its scheduler slept: loader commands, messages, new threads.
+void Lua_Wake(struct lua_State* L);
+
+// Have the next idle time collect L's garbage, instead of a full
+// collection now.
+void Lua_Idle_Gc(struct lua_State* L);
+
+// Staged reset. Lua_Stage_Begin() builds a fresh state next to the
+// selected one and loader commands go to it until Lua_Stage_Commit()
+// swaps it in. If any load into the staged state failed, the commit
+// rolls back instead and the old app keeps running.
+bool Lua_Stage_Begin();
+void Lua_Stage_Fail();
+bool Lua_Stage_Commit();
+void Lua_Stage_Abort();
+
+// Allocator accounting for a state, or null if it uses the libc heap.
+struct Luatt_Heap* Lua_Heap(struct lua_State* L);
+
+// Callbacks Lua code registers with Luatt.set_cb_*().
+enum {
+    LUATT_CB_SCHED_LOOP,
+    LUATT_CB_ON_MSG,
+    LUATT_CB_SPAWN,
+    LUATT_CB_LOW_MEM,
+    LUATT_CB_COUNT
+};
+
+extern const char* const Luatt_Callback_Names[LUATT_CB_COUNT];
+
+// Steps of building a Lua state, see Luatt_Context::reset_us.
+enum {
+    LUATT_RESET_CLOSE,      // closing the old state, Lua_Reset() only
+    LUATT_RESET_STATE,      // lua_newstate() and the Luatt context
+    LUATT_RESET_LIBS,       // Luatt_Config::libs
+    LUATT_RESET_LUATT,      // Luatt tables and functions
+    LUATT_RESET_SETUP,      // the Lua_Begin() setup callback
+    LUATT_RESET_SNAPSHOT,   // copies for Lua_Soft_Reset()
+    LUATT_RESET_PHASES
+};
+
+extern const char* const Luatt_Reset_Phase_Names[LUATT_RESET_PHASES];
+
+struct Luatt_Callback_Stats {
+    uint32_t calls;
+    uint32_t errors;
+    uint32_t max_us;
+    uint64_t total_us;
+};
+
+// C side data for each Lua state, found with lua_getextraspace().
+struct Luatt_Context {
+    Luatt_Heap heap;
+    int cb_ref[LUATT_CB_COUNT];     // luaL_ref() in the registry
+    Luatt_Callback_Stats cb_stats[LUATT_CB_COUNT];
+
+    bool gc_in_cycle;   // idle GC has a cycle to start or finish
+    int gc_kb_after;    // heap size when the last idle cycle finished
+
+    // see Luatt_Config, Luatt.set_budget() changes them
+    uint32_t resume_budget_us;
+    uint32_t eval_budget_us;
+
+    struct Luatt_Budget {
+        uint32_t start;     // micros()
+        uint32_t us;        // 0 when not running under a budget
+        struct lua_State* thread;   // the one that may be preempted
+        bool overrun;
+    } budget;
+    uint32_t overruns;
+
+    uint32_t gc_cycles;     // collections that finished, all kinds
+    bool closing;
+
+    // Lua_Loop timing, microseconds, see Luatt.dbg.latency()
+    Luatt_Hist tick_us;     // scheduler.loop run time
+    Luatt_Hist late_us;     // start of a tick past the sleep it asked for
+
+    // What building this state cost, by LUATT_RESET_* phase. Bytes are
+    // Lua heap in use after the phase less before it.
+    uint32_t reset_us[LUATT_RESET_PHASES];
+    uint32_t reset_bytes[LUATT_RESET_PHASES];
+};
+
+struct Luatt_Context* Lua_Context(struct lua_State* L);
+
+// Set callback cb to the function at idx, or clear it if that's nil.
+void Lua_Set_Callback(struct lua_State* L, int cb, int idx);
+
+// Call callback cb with the nargs values on top of the stack, like
+// lua_pcall(). Returns LUATT_NO_CALLBACK, with the args popped, if
+// Lua hasn't set one.
+#define LUATT_NO_CALLBACK (-1)
+int Lua_Call_Callback(struct lua_State* L, int cb, int nargs, int nresults);
+
+// Run Lua code under an execution budget of us microseconds, see
+// Luatt_Config::resume_budget_us. Returns true from Lua_Budget_End()
+// if the code overran it. Doesn't nest, save Luatt_Context::budget
+// around inner budgets.
+void Lua_Budget_Begin(struct lua_State* L, uint32_t us);
+bool Lua_Budget_End(struct lua_State* L);
+
+// Charge Lua allocations from now on to the named owner, see
+// Luatt_Alloc_Owner. The loader uses the command or module name and
+// the scheduler uses the task's mux token.
+void Lua_Set_Owner(const char* name);
+
+// State that loader commands operate on: the staged state if there
+// is one for the selected state, otherwise the selected state.
+struct lua_State* Lua_Target();
 
 #endif
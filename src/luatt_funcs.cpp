@@ -1,10 +1,16 @@
 #include <Arduino.h>
 #include <Adafruit_TinyUSB.h>
 
+#include <ctype.h>
 #include <malloc.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "luatt_context.h"
+#include "luatt_output.h"
 #include "luatt_funcs.h"
+#include "luatt_log.h"
+#include "luatt_rom.h"
 
 // Wrapper functions exported to Lua.
 //
@@ -80,42 +86,575 @@ static int lf_meminfo(lua_State *L) {
 #ifdef ARDUINO_NRF52840_ITSYBITSY
     dbgMemInfo();
 #elif defined(ARDUINO_RASPBERRY_PI_PICO)
-    Serial.printf("Heap used: %i\n", rp2040.getUsedHeap());
-    Serial.printf("Heap free: %i\n", rp2040.getFreeHeap());
+    Luatt_Out.printf("Heap used: %i\n", rp2040.getUsedHeap());
+    Luatt_Out.printf("Heap free: %i\n", rp2040.getFreeHeap());
 #else
-    Serial.print("Error: dbgMemInfo() not supported.\n");
+    Luatt_Out.print("Error: dbgMemInfo() not supported.\n");
 #endif
+    Luatt_Heap* heap = Lua_Heap(L);
+    if (heap) {
+        Luatt_Out.printf("Lua heap used: %i\n", (int)heap->in_use);
+        Luatt_Out.printf("Lua heap peak: %i\n", (int)heap->peak);
+    }
+    return 0;
+}
+
+static void set_int_field(lua_State* L, const char* k, lua_Integer v) {
+    lua_pushinteger(L, v);
+    lua_setfield(L, -2, k);
+}
+
+// Luatt.dbg.heap() returns a table of allocator statistics.
+static int lf_dbg_heap(lua_State *L) {
+    lua_newtable(L);
+    Luatt_Heap* heap = Lua_Heap(L);
+    if (!heap) {
+        // libc heap
+        set_int_field(L, "in_use", lua_gc(L, LUA_GCCOUNT) * 1024 + lua_gc(L, LUA_GCCOUNTB));
+        return 1;
+    }
+    set_int_field(L, "in_use", heap->in_use);
+    set_int_field(L, "peak", heap->peak);
+    set_int_field(L, "allocs", heap->allocs);
+    set_int_field(L, "frees", heap->frees);
+    Luatt_Alloc_Settle(heap);
+    set_int_field(L, "failures", heap->failures);
+    set_int_field(L, "retries", heap->retries);
+    set_int_field(L, "ceiling", heap->ceiling);
+    set_int_field(L, "ceiling_hits", heap->ceiling_hits);
+    set_int_field(L, "pressure_events", heap->pressure_events);
+
+    Luatt_Alloc_Stats st;
+    Luatt_Alloc_Get_Stats(&st);
+    set_int_field(L, "arena", st.arena_size);
+    set_int_field(L, "pool_size", st.pool_size);
+    set_int_field(L, "pool_used", st.pool_used);
+    set_int_field(L, "pool_free", st.pool_free);
+    set_int_field(L, "pool_pages_free", st.pool_pages_free);
+    set_int_field(L, "pool_fallbacks", st.pool_fallbacks);
+    set_int_field(L, "tlsf_size", st.tlsf_size);
+    set_int_field(L, "tlsf_used", st.tlsf_used);
+    set_int_field(L, "tlsf_free", st.tlsf_free);
+    set_int_field(L, "tlsf_largest_free", st.tlsf_largest_free);
+    set_int_field(L, "tlsf_free_blocks", st.tlsf_free_blocks);
+
+    // percent of free TLSF space not in the largest block
+    int frag = 0;
+    if (st.tlsf_free) {
+        frag = 100 - (int)((uint64_t)st.tlsf_largest_free * 100 / st.tlsf_free);
+    }
+    set_int_field(L, "fragmentation", frag);
+    return 1;
+}
+
+// Luatt.dbg.owners() returns memory use by owner:
+// { [name] = { live=, peak=, allocs=, frees=, limit=, failures= } }
+static int lf_dbg_owners(lua_State *L) {
+    int n;
+    const Luatt_Alloc_Owner* owners = Luatt_Alloc_Get_Owners(&n);
+    lua_createtable(L, 0, n);
+    for (int i = 0; i < n; i++) {
+        const Luatt_Alloc_Owner* o = &owners[i];
+        if (!o->name[0]) continue;
+        lua_createtable(L, 0, 6);
+        set_int_field(L, "live", o->live);
+        set_int_field(L, "peak", o->peak);
+        set_int_field(L, "allocs", o->allocs);
+        set_int_field(L, "frees", o->frees);
+        set_int_field(L, "limit", o->limit);
+        set_int_field(L, "failures", o->failures);
+        lua_setfield(L, -2, o->name);
+    }
+    return 1;
+}
+
+// Luatt.dbg.set_limit(name, bytes) limits memory charged to an owner.
+// Zero removes the limit.
+static int lf_dbg_set_limit(lua_State *L) {
+    const char* name = luaL_checkstring(L, 1);
+    lua_Integer limit = luaL_checkinteger(L, 2);
+    int id = Luatt_Alloc_Owner_Id(name);
+    if (id == 0) {
+        return luaL_error(L, "owner table full");
+    }
+    Luatt_Alloc_Set_Limit(id, limit > 0 ? limit : 0);
+    return 0;
+}
+
+// Luatt.dbg.callbacks([reset]) returns timing for the Luatt.set_cb_*()
+// callbacks: { [name] = { calls=, errors=, total_us=, max_us= } }
+static int lf_dbg_callbacks(lua_State *L) {
+    Luatt_Context* ctx = Lua_Context(L);
+    lua_createtable(L, 0, LUATT_CB_COUNT);
+    for (int cb = 0; cb < LUATT_CB_COUNT; cb++) {
+        Luatt_Callback_Stats* st = &ctx->cb_stats[cb];
+        lua_createtable(L, 0, 4);
+        set_int_field(L, "calls", st->calls);
+        set_int_field(L, "errors", st->errors);
+        set_int_field(L, "total_us", st->total_us);
+        set_int_field(L, "max_us", st->max_us);
+        lua_setfield(L, -2, Luatt_Callback_Names[cb]);
+    }
+    if (lua_toboolean(L, 1)) {
+        memset(ctx->cb_stats, 0, sizeof(ctx->cb_stats));
+    }
+    return 1;
+}
+
+// Luatt.dbg.reset() returns what building this state cost, by phase:
+// { [phase] = { us=, bytes= } }, see LUATT_RESET_*.
+static int lf_dbg_reset(lua_State *L) {
+    Luatt_Context* ctx = Lua_Context(L);
+    lua_createtable(L, 0, LUATT_RESET_PHASES);
+    for (int i = 0; i < LUATT_RESET_PHASES; i++) {
+        lua_createtable(L, 0, 2);
+        set_int_field(L, "us", ctx->reset_us[i]);
+        set_int_field(L, "bytes", ctx->reset_bytes[i]);
+        lua_setfield(L, -2, Luatt_Reset_Phase_Names[i]);
+    }
+    return 1;
+}
+
+// Luatt.dbg.overruns([reset]) returns { [task token] = count } of
+// scheduler threads preempted or stopped by the resume budget.
+static int lf_dbg_overruns(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, "luatt_overruns");
+    if (lua_toboolean(L, 1)) {
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, "luatt_overruns");
+    }
+    return 1;
+}
+
+// Luatt.resume(co, ...) is coroutine.resume() under the resume budget.
+static int lf_resume(lua_State *L) {
+    lua_State* co = lua_tothread(L, 1);
+    luaL_argexpected(L, co, 1, "thread");
+    int nargs = lua_gettop(L) - 1;
+
+    int status = lua_status(co);
+    if (status != LUA_YIELD && (status != LUA_OK || lua_gettop(co) == 0)) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "cannot resume dead coroutine");
+        return 2;
+    }
+    if (!lua_checkstack(co, nargs)) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "too many arguments to resume");
+        return 2;
+    }
+    lua_xmove(L, co, nargs);
+
+    Luatt_Context* ctx = Lua_Context(L);
+    Luatt_Context::Luatt_Budget outer = ctx->budget;
+    Lua_Budget_Begin(L, ctx->resume_budget_us);
+    ctx->budget.thread = co;
+    const void* outer_line = Luatt_Out.set_line_owner(co);
+    int nres;
+    status = lua_resume(co, L, nargs, &nres);
+    bool overrun = Lua_Budget_End(L);
+    ctx->budget = outer;
+    if (status != LUA_YIELD) Luatt_Out.flush_line();
+    Luatt_Out.set_line_owner(outer_line);
+
+    if (overrun) {
+        const char* token = Luatt_Out.get_mux_token();
+        lua_getfield(L, LUA_REGISTRYINDEX, "luatt_overruns");
+        lua_getfield(L, -1, token);
+        lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+        lua_setfield(L, -3, token);
+        lua_pop(L, 2);
+    }
+
+    if (status == LUA_OK || status == LUA_YIELD) {
+        if (!lua_checkstack(L, nres + 1)) {
+            lua_pop(co, nres);
+            lua_pushboolean(L, 0);
+            lua_pushliteral(L, "too many results to resume");
+            return 2;
+        }
+        lua_pushboolean(L, 1);
+        lua_xmove(co, L, nres);
+        return nres + 1;
+    }
+    lua_pushboolean(L, 0);
+    lua_xmove(co, L, 1); // error message
+    return 2;
+}
+
+// Luatt.wake() runs the scheduler on the next Lua_Loop, for a thread
+// that was started or woken outside a scheduler tick.
+static int lf_wake(lua_State *L) {
+    Lua_Wake(L);
+    return 0;
+}
+
+// Luatt.set_budget(resume_us, eval_us), nil keeps the current value.
+static int lf_set_budget(lua_State *L) {
+    Luatt_Context* ctx = Lua_Context(L);
+    ctx->resume_budget_us = luaL_optinteger(L, 1, ctx->resume_budget_us);
+    ctx->eval_budget_us = luaL_optinteger(L, 2, ctx->eval_budget_us);
+    return 0;
+}
+
+static void push_hist(lua_State *L, const Luatt_Hist* h) {
+    lua_createtable(L, 0, 10);
+    set_int_field(L, "count", h->count);
+    set_int_field(L, "min", h->min);
+    set_int_field(L, "max", h->max);
+    set_int_field(L, "mean", h->count ? h->total / h->count : 0);
+    set_int_field(L, "p50", Luatt_Hist_Percentile(h, 500));
+    set_int_field(L, "p90", Luatt_Hist_Percentile(h, 900));
+    set_int_field(L, "p99", Luatt_Hist_Percentile(h, 990));
+    set_int_field(L, "p999", Luatt_Hist_Percentile(h, 999));
+
+    // { [bucket low] = count } for non-empty buckets
+    lua_newtable(L);
+    for (int i = 0; i < LUATT_HIST_BUCKETS; i++) {
+        if (!h->bucket[i]) continue;
+        lua_pushinteger(L, h->bucket[i]);
+        lua_rawseti(L, -2, Luatt_Hist_Bucket_Low(i));
+    }
+    lua_setfield(L, -2, "buckets");
+}
+
+// Luatt.dbg.latency([reset]) returns histograms, in microseconds, of
+// scheduler.loop run time (tick) and how late ticks start (late).
+static int lf_dbg_latency(lua_State *L) {
+    Luatt_Context* ctx = Lua_Context(L);
+    lua_createtable(L, 0, 2);
+    push_hist(L, &ctx->tick_us);
+    lua_setfield(L, -2, "tick");
+    push_hist(L, &ctx->late_us);
+    lua_setfield(L, -2, "late");
+    if (lua_toboolean(L, 1)) {
+        Luatt_Hist_Reset(&ctx->tick_us);
+        Luatt_Hist_Reset(&ctx->late_us);
+    }
+    return 1;
+}
+
+// Mux tokens are handed to Lua as userdata holding the interned id, which
+// keeps the id from being reused until it's collected or released. The
+// id is -1 once released.
+static int mux_token_gc(lua_State *L) {
+    int* id = (int*) lua_touserdata(L, 1);
+    if (*id >= 0) Luatt_Out.release_token(*id);
     return 0;
 }
 
+static int mux_token_tostring(lua_State *L) {
+    int id = *(int*) lua_touserdata(L, 1);
+    lua_pushstring(L, id >= 0 ? Luatt_Out.token_name(id) : "released");
+    return 1;
+}
+
+static int mux_token_eq(lua_State *L) {
+    int* a = (int*) luaL_testudata(L, 1, "luatt_mux_token");
+    int* b = (int*) luaL_testudata(L, 2, "luatt_mux_token");
+    lua_pushboolean(L, a && b && *a == *b);
+    return 1;
+}
+
+static void push_mux_token(lua_State *L, int id) {
+    int* p = (int*) lua_newuserdatauv(L, sizeof(int), 0);
+    *p = id;
+    if (luaL_newmetatable(L, "luatt_mux_token")) {
+        static const luaL_Reg meta[] = {
+            { "__gc",       mux_token_gc },
+            { "__tostring", mux_token_tostring },
+            { "__eq",       mux_token_eq },
+            { 0, 0 }
+        };
+        luaL_setfuncs(L, meta, 0);
+    }
+    lua_setmetatable(L, -2);
+    Luatt_Out.hold_token(id);
+}
+
+// Luatt.mux_token(name) interns a token for set_mux_token().
+static int lf_mux_token(lua_State *L) {
+    push_mux_token(L, Luatt_Out.intern_token(luaL_checkstring(L, 1)));
+    return 1;
+}
+
 static int lf_get_mux_token(lua_State *L) {
-    lua_pushstring(L, Serial.get_mux_token());
+    push_mux_token(L, Luatt_Out.get_mux_token_id());
     return 1;
 }
 
+// Luatt.set_mux_token(token), from mux_token() or get_mux_token(), or a
+// name which has to be looked up.
 static int lf_set_mux_token(lua_State *L) {
-    const char* token = luaL_checkstring(L, 1);
-    Serial.set_mux_token(token);
+    int* id = (int*) luaL_testudata(L, 1, "luatt_mux_token");
+    if (id) {
+        luaL_argcheck(L, *id >= 0, 1, "released mux token");
+        Luatt_Out.set_mux_token(*id);
+    }
+    else Luatt_Out.set_mux_token(luaL_checkstring(L, 1));
+    Luatt_Alloc_Set_Owner(Luatt_Out.token_owner(Luatt_Out.get_mux_token_id()));
+    return 0;
+}
+
+// Luatt.release_mux_token(token) lets the token's id be reused now rather
+// than when the handle is collected, for threads that have ended.
+static int lf_release_mux_token(lua_State *L) {
+    int* id = (int*) luaL_checkudata(L, 1, "luatt_mux_token");
+    if (*id >= 0) Luatt_Out.release_token(*id);
+    *id = -1;
+    return 0;
+}
+
+// Luatt.set_out_policy("block" | "drop_oldest" | "drop_newest")
+// What to do with output when USB is behind, returns the old policy.
+static int lf_set_out_policy(lua_State *L) {
+    static const char* const names[] = { "block", "drop_oldest", "drop_newest", 0 };
+    int old = Luatt_Out.set_policy(luaL_checkoption(L, 1, 0, names));
+    lua_pushstring(L, names[old]);
+    return 1;
+}
+
+// Write v as tostring() would, without making a string for the common types.
+static void out_value(lua_State* L, int i) {
+    char buf[32];
+    int n;
+    switch (lua_type(L, i)) {
+    case LUA_TSTRING: {
+        size_t len;
+        const char* s = lua_tolstring(L, i, &len);
+        Luatt_Out.write((const uint8_t*)s, len);
+        return;
+    }
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, i)) {
+            n = snprintf(buf, sizeof(buf), "%lld", (long long) lua_tointeger(L, i));
+        } else {
+            n = snprintf(buf, sizeof(buf), "%.14g", (double) lua_tonumber(L, i));
+            // 1.0 not 1, like lua_Number2str
+            if (buf[strspn(buf, "-0123456789")] == 0) {
+                buf[n++] = '.';
+                buf[n++] = '0';
+            }
+        }
+        Luatt_Out.write((const uint8_t*)buf, n);
+        return;
+    case LUA_TBOOLEAN:
+        Luatt_Out.print(lua_toboolean(L, i) ? "true" : "false");
+        return;
+    case LUA_TNIL:
+        Luatt_Out.print("nil");
+        return;
+    }
+    size_t len;
+    const char* s = luaL_tolstring(L, i, &len);
+    Luatt_Out.write((const uint8_t*)s, len);
+    lua_pop(L, 1);
+}
+
+// Replaces the global print, which writes to stdout, so that it goes
+// through Luatt_Out's ring.
+static int lf_print(lua_State *L) {
+    int n = lua_gettop(L);
+    for (int i = 1; i <= n; i++) {
+        if (i > 1) Luatt_Out.write('\t');
+        out_value(L, i);
+    }
+    Luatt_Out.write('\n');
+    return 0;
+}
+
+// Luatt.printf(fmt, ...) is io.write(string.format(fmt, ...)) into
+// Luatt_Out, formatting each conversion on the C stack. %s of a string,
+// number, boolean or nil makes no Lua string. No %q.
+static int lf_printf(lua_State *L) {
+    size_t fmt_len;
+    const char* fmt = luaL_checklstring(L, 1, &fmt_len);
+    const char* end = fmt + fmt_len;
+    int arg = 1;
+    char buf[128];
+
+    while (fmt < end) {
+        const char* pct = (const char*) memchr(fmt, '%', end - fmt);
+        if (!pct) pct = end;
+        Luatt_Out.write((const uint8_t*)fmt, pct - fmt);
+        if (pct == end) break;
+        fmt = pct + 1;
+        if (fmt < end && *fmt == '%') {
+            Luatt_Out.write('%');
+            fmt++;
+            continue;
+        }
+
+        // flags, width and precision, at most 2 digits each like string.format
+        char spec[16] = "%";
+        size_t spec_len = 1;
+        size_t n = strspn(fmt, "-+ #0");
+        if (n > 5) n = 5;
+        const char* p = fmt + n;
+        for (int j = 0; j < 2 && isdigit((unsigned char)*p); j++) p++;
+        if (*p == '.') {
+            p++;
+            for (int j = 0; j < 2 && isdigit((unsigned char)*p); j++) p++;
+        }
+        if (p >= end) return luaL_error(L, "invalid conversion '%s' to 'printf'", pct);
+        memcpy(spec + spec_len, fmt, p - fmt);
+        spec_len += p - fmt;
+        bool plain = (p == fmt);
+        char conv = *p;
+        fmt = p + 1;
+        arg++;
+
+        int len;
+        switch (conv) {
+        case 'c':
+            spec[spec_len++] = 'c';
+            spec[spec_len] = 0;
+            len = snprintf(buf, sizeof(buf), spec, (int) luaL_checkinteger(L, arg));
+            break;
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+            spec[spec_len++] = 'l';
+            spec[spec_len++] = 'l';
+            spec[spec_len++] = conv;
+            spec[spec_len] = 0;
+            len = snprintf(buf, sizeof(buf), spec, (long long) luaL_checkinteger(L, arg));
+            break;
+        case 'a': case 'A': case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+            spec[spec_len++] = conv;
+            spec[spec_len] = 0;
+            len = snprintf(buf, sizeof(buf), spec, (double) luaL_checknumber(L, arg));
+            break;
+        case 's': {
+            luaL_checkany(L, arg);
+            if (plain) {
+                out_value(L, arg);
+                continue;
+            }
+            size_t s_len;
+            const char* s = luaL_tolstring(L, arg, &s_len);
+            if (s_len >= 100 && !memchr(spec, '.', spec_len)) {
+                // too long for the width to matter, same as string.format
+                Luatt_Out.write((const uint8_t*)s, s_len);
+                lua_pop(L, 1);
+                continue;
+            }
+            spec[spec_len++] = 's';
+            spec[spec_len] = 0;
+            len = snprintf(buf, sizeof(buf), spec, s);
+            lua_pop(L, 1);
+            break;
+        }
+        default:
+            return luaL_error(L, "invalid conversion '%%%c' to 'printf'", conv);
+        }
+
+        if (len < 0) continue;
+        if ((size_t) len < sizeof(buf)) {
+            Luatt_Out.write((const uint8_t*)buf, len);
+            continue;
+        }
+        // only floats get this long, %99.99f of a big number
+        char* big = (char*) malloc(len + 1);
+        if (!big) return luaL_error(L, "not enough memory");
+        snprintf(big, len + 1, spec, (double) luaL_checknumber(L, arg));
+        Luatt_Out.write((const uint8_t*)big, len);
+        free(big);
+    }
+    return 0;
+}
+
+// Luatt.log(fmt, ...) logs a line through luatt_log.h, fmt is a format
+// for Luatt.printf() without the newline.
+static int lf_log(lua_State *L) {
+    const char* fmt = luaL_checkstring(L, 1);
+
+    // check the arguments first, an error halfway would leave half a line
+    char conv, mod;
+    int arg = 1;
+    for (const char* p = fmt; (p = Luatt_Log_Scan(p, &conv, &mod)); ) {
+        arg++;
+        if (!conv) return luaL_error(L, "invalid conversion in '%s' to 'log'", fmt);
+        if (conv == 's') luaL_checkany(L, arg);
+        else if (strchr("diucoxX", conv)) luaL_checkinteger(L, arg);
+        else luaL_checknumber(L, arg);
+    }
+
+    // fmt -> id, per state
+    if (lua_getfield(L, LUA_REGISTRYINDEX, "luatt_log_ids") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, "luatt_log_ids");
+    }
+    lua_pushvalue(L, 1);
+    int id;
+    if (lua_rawget(L, -2) == LUA_TNUMBER) {
+        id = lua_tointeger(L, -1);
+    }
+    else {
+        id = Luatt_Log_Id(fmt, true);
+        lua_pushvalue(L, 1);
+        lua_pushinteger(L, id);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 2);
+
+    if (id < 0) {
+        lf_printf(L);
+        Luatt_Out.write('\n');
+        return 0;
+    }
+
+    Luatt_Log_Begin(id);
+    arg = 1;
+    for (const char* p = fmt; (p = Luatt_Log_Scan(p, &conv, &mod)); ) {
+        arg++;
+        switch (conv) {
+        case 'd': case 'i': case 'c':
+            Luatt_Log_Int(lua_tointeger(L, arg));
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            Luatt_Log_Uint((unsigned long long) lua_tointeger(L, arg));
+            break;
+        case 's': {
+            size_t len;
+            const char* s = luaL_tolstring(L, arg, &len);
+            Luatt_Log_String(s, len);
+            lua_pop(L, 1);
+            break;
+        }
+        default:
+            Luatt_Log_Double(lua_tonumber(L, arg));
+            break;
+        }
+    }
+    Luatt_Log_End();
     return 0;
 }
 
+// 16 bytes per line, in groups of 4.
 static int lf_print_hex(struct lua_State* L) {
+    static const char hex[] = "0123456789abcdef";
     size_t len;
-    const char* data = luaL_checklstring(L, 1, &len);
-    size_t i;
-    for (i = 0; i < len; i++) {
+    const uint8_t* data = (const uint8_t*)luaL_checklstring(L, 1, &len);
+    char line[40];
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
         if (i == 0) {
             // pass
         }
         else if ((i & 15) == 0) {
-            Serial.print("\n");
+            line[n++] = '\n';
+            Luatt_Out.write((const uint8_t*)line, n);
+            n = 0;
         }
         else if ((i & 3) == 0) {
-            Serial.print(" ");
+            line[n++] = ' ';
         }
-        Serial.printf("%02x", data[i]);
+        line[n++] = hex[data[i] >> 4];
+        line[n++] = hex[data[i] & 15];
     }
-    Serial.print("\n");
+    line[n++] = '\n';
+    Luatt_Out.write((const uint8_t*)line, n);
     return 0;
 }
 
@@ -123,7 +662,8 @@ static int lf_set_cb_sched_loop(struct lua_State* L) {
     if (!lua_isfunction(L, 1)) {
         return luaL_error(L, "sched_loop callback must be a function");
     }
-    lua_setfield(L, LUA_REGISTRYINDEX, "luatt_sched_loop");
+    Lua_Set_Callback(L, LUATT_CB_SCHED_LOOP, 1);
+    Lua_Wake(L);
     return 0;
 }
 
@@ -131,7 +671,23 @@ static int lf_set_cb_on_msg(struct lua_State* L) {
     if (!lua_isfunction(L, 1)) {
         return luaL_error(L, "on_msg callback must be a function");
     }
-    lua_setfield(L, LUA_REGISTRYINDEX, "luatt_on_msg");
+    Lua_Set_Callback(L, LUATT_CB_ON_MSG, 1);
+    return 0;
+}
+
+static int lf_set_cb_spawn(struct lua_State* L) {
+    if (!lua_isfunction(L, 1)) {
+        return luaL_error(L, "spawn callback must be a function");
+    }
+    Lua_Set_Callback(L, LUATT_CB_SPAWN, 1);
+    return 0;
+}
+
+static int lf_set_cb_low_mem(struct lua_State* L) {
+    if (!lua_isfunction(L, 1)) {
+        return luaL_error(L, "low_mem callback must be a function");
+    }
+    Lua_Set_Callback(L, LUATT_CB_LOW_MEM, 1);
     return 0;
 }
 
@@ -142,14 +698,23 @@ void luatt_setfuncs(lua_State* L) {
     static const struct luaL_Reg luatt_table[] = {
         { "set_cb_sched_loop", lf_set_cb_sched_loop },
         { "set_cb_on_msg",     lf_set_cb_on_msg },
+        { "set_cb_spawn",      lf_set_cb_spawn },
+        { "set_cb_low_mem",    lf_set_cb_low_mem },
+        { "resume",         lf_resume },
+        { "set_budget",     lf_set_budget },
+        { "wake",           lf_wake },
+        { "mux_token",      lf_mux_token },
         { "get_mux_token",  lf_get_mux_token },
         { "set_mux_token",  lf_set_mux_token },
+        { "release_mux_token", lf_release_mux_token },
+        { "set_out_policy", lf_set_out_policy },
+        { "printf",         lf_printf },
+        { "log",            lf_log },
         { 0, 0 }
     };
-    luaL_setfuncs(L, luatt_table, 0);
+    Luatt_Rom_Index(L, -1, luatt_table);
 
     // Luatt.time
-    lua_newtable(L);
     static const struct luaL_Reg time_table[] = {
         { "millis",    lf_time_millis },
         { "micros",    lf_time_micros },
@@ -161,15 +726,33 @@ void luatt_setfuncs(lua_State* L) {
         { "yield",     lf_time_yield },
         { 0, 0 }
     };
-    luaL_setfuncs(L, time_table, 0);
+    Luatt_Rom_Push(L, time_table);
     lua_setfield(L, -2, "time");
 
     lua_pop(L, 1);
 
+    // Luatt.dbg
+    lua_getfield(L, LUA_REGISTRYINDEX, "luatt_dbg");
+    static const struct luaL_Reg dbg_table[] = {
+        { "heap",      lf_dbg_heap },
+        { "callbacks", lf_dbg_callbacks },
+        { "overruns",  lf_dbg_overruns },
+        { "latency",   lf_dbg_latency },
+        { "reset",     lf_dbg_reset },
+        { "owners",    lf_dbg_owners },
+        { "set_limit", lf_dbg_set_limit },
+        { 0, 0 }
+    };
+    Luatt_Rom_Index(L, -1, dbg_table);
+    lua_pop(L, 1);
+
 
     lua_pushcfunction(L, lf_meminfo);
     lua_setglobal(L, "meminfo");
 
     lua_pushcfunction(L, lf_print_hex);
     lua_setglobal(L, "print_hex");
+
+    lua_pushcfunction(L, lf_print);
+    lua_setglobal(L, "print");
 }
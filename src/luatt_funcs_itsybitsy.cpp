@@ -4,88 +4,52 @@
 #include <Adafruit_TinyUSB.h>
 #include <Adafruit_DotStar.h>
 
+#include "luatt_bind.h"
 #include "luatt_context.h"
 #include "luatt_funcs_itsybitsy.h"
 
 ///////////////////////////////////
 // Dotstar LED (single).
 
-static Adafruit_DotStar* get_dotstar_upvalue(lua_State *L) {
-    if (!lua_islightuserdata(L, lua_upvalueindex(1))) {
-        luaL_error(L, "BUG: upvalue 1 not an Adafruit_DotStar light userdata");
-        return 0; // luaL_error doesn't return
-    }
-    Adafruit_DotStar* led = (Adafruit_DotStar*) lua_topointer(L, lua_upvalueindex(1));
-    if (!led) {
-        luaL_error(L, "BUG: upvalue is null");
-        return 0; // luaL_error doesn't return
-    }
-    return led;
-}
+// Helpers with the Adafruit_DotStar in upvalue 1, see luatt_bind.h.
+// Show is for implicit_show.
 
-static int lf_dotstar_set_brightness(lua_State *L) {
-    int x = 256 * luaL_checknumber(L, 1);
+template<bool Show>
+static void dotstar_set_brightness(Adafruit_DotStar* led, float brightness) {
+    int x = 256 * brightness;
     if (x < 0) x = 0;
     else if (x > 255) x = 255;
-    get_dotstar_upvalue(L)->setBrightness(x);
-    return 0;
-}
-
-static int lf_dotstar_set_brightness_show(lua_State *L) {
-    int r = lf_dotstar_set_brightness(L);
-    get_dotstar_upvalue(L)->show();
-    return r;
+    led->setBrightness(x);
+    if (Show) led->show();
 }
 
-static int lf_dotstar_set_color(lua_State *L) {
-    uint32_t x = luaL_checkinteger(L, 1);
-    get_dotstar_upvalue(L)->setPixelColor(0, x);
-    return 0;
+template<bool Show>
+static void dotstar_set_color(Adafruit_DotStar* led, uint32_t rgb) {
+    led->setPixelColor(0, rgb);
+    if (Show) led->show();
 }
 
-static int lf_dotstar_set_color_show(lua_State *L) {
-    int r = lf_dotstar_set_color(L);
-    get_dotstar_upvalue(L)->show();
-    return r;
-}
-
-static int lf_dotstar_set_hsv(lua_State *L) {
-    uint16_t hue = luaL_checkinteger(L, 1);
-    int ok;
-    uint8_t sat = lua_tointegerx(L, 2, &ok);
-    if (!ok) sat = 255;
-    uint8_t val = lua_tointegerx(L, 3, &ok);
-    if (!ok) val = 255;
-    uint32_t rgb = Adafruit_DotStar::ColorHSV(hue, sat, val);
-    get_dotstar_upvalue(L)->setPixelColor(0, rgb);
-    return 0;
-}
-
-static int lf_dotstar_set_hsv_show(lua_State *L) {
-    int r = lf_dotstar_set_hsv(L);
-    get_dotstar_upvalue(L)->show();
-    return r;
-}
-
-static int lf_dotstar_show(lua_State *L) {
-    get_dotstar_upvalue(L)->show();
-    return 0;
+template<bool Show>
+static void dotstar_set_hsv(Adafruit_DotStar* led, uint16_t hue,
+                            luatt::Opt<uint8_t, 255> sat, luatt::Opt<uint8_t, 255> val) {
+    led->setPixelColor(0, Adafruit_DotStar::ColorHSV(hue, sat, val));
+    if (Show) led->show();
 }
 
 void luatt_setfuncs_dotstar(lua_State* L, Adafruit_DotStar* dotstar, bool implicit_show) {
-    static const struct luaL_Reg dotstar_show_table[] = {
-        { "set_brightness", lf_dotstar_set_brightness_show },
-        { "set_color",      lf_dotstar_set_color_show },
-        { "set_hsv",        lf_dotstar_set_hsv_show },
-        { "show",           lf_dotstar_show },
+    static constexpr luaL_Reg dotstar_show_table[] = {
+        { "set_brightness", LUATT_METHOD(&dotstar_set_brightness<true>) },
+        { "set_color",      LUATT_METHOD(&dotstar_set_color<true>) },
+        { "set_hsv",        LUATT_METHOD(&dotstar_set_hsv<true>) },
+        { "show",           LUATT_METHOD(&Adafruit_DotStar::show) },
         { 0, 0 }
     };
 
-    static const struct luaL_Reg dotstar_table[] = {
-        { "set_brightness", lf_dotstar_set_brightness },
-        { "set_color",      lf_dotstar_set_color },
-        { "set_hsv",        lf_dotstar_set_hsv },
-        { "show",           lf_dotstar_show },
+    static constexpr luaL_Reg dotstar_table[] = {
+        { "set_brightness", LUATT_METHOD(&dotstar_set_brightness<false>) },
+        { "set_color",      LUATT_METHOD(&dotstar_set_color<false>) },
+        { "set_hsv",        LUATT_METHOD(&dotstar_set_hsv<false>) },
+        { "show",           LUATT_METHOD(&Adafruit_DotStar::show) },
         { 0, 0 }
     };
 
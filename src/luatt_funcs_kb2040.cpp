@@ -6,6 +6,7 @@
 
 #include "luatt_context.h"
 #include "luatt_funcs_kb2040.h"
+#include "luatt_rom.h"
 
 ///////////////////////////////////
 // NeoPixel LED (single).
@@ -72,7 +73,7 @@ void luatt_setfuncs_neopixel(lua_State* L, Adafruit_NeoPixel* neopix, bool impli
         { "show",           lf_neopix_show },
         { 0, 0 }
     };
-    luaL_setfuncs(L, neopix_table, 0);
+    Luatt_Rom_Index(L, -1, neopix_table);
 }
 
 #endif
@@ -0,0 +1,57 @@
+#include <string.h>
+
+#include "luatt_hist.h"
+
+#define SUB (1 << LUATT_HIST_SUB_BITS)
+
+static int msb(uint32_t v) {
+    return 31 - __builtin_clz(v);
+}
+
+static int bucket_index(uint32_t v) {
+    if (v < SUB) return v;
+    if (v >> LUATT_HIST_MAX_BITS) v = (1u << LUATT_HIST_MAX_BITS) - 1;
+    int e = msb(v);
+    int shift = e - LUATT_HIST_SUB_BITS;
+    return ((shift + 1) << LUATT_HIST_SUB_BITS) + ((v >> shift) & (SUB - 1));
+}
+
+uint32_t Luatt_Hist_Bucket_Low(int i) {
+    if (i < SUB) return i;
+    int shift = (i >> LUATT_HIST_SUB_BITS) - 1;
+    return (uint32_t)(SUB | (i & (SUB - 1))) << shift;
+}
+
+static uint32_t bucket_high(int i) {
+    if (i < SUB) return i;
+    int shift = (i >> LUATT_HIST_SUB_BITS) - 1;
+    return Luatt_Hist_Bucket_Low(i) + (1u << shift) - 1;
+}
+
+void Luatt_Hist_Reset(Luatt_Hist* h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void Luatt_Hist_Add(Luatt_Hist* h, uint32_t v) {
+    if (!h->count || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->count++;
+    h->total += v;
+    h->bucket[bucket_index(v)]++;
+}
+
+uint32_t Luatt_Hist_Percentile(const Luatt_Hist* h, int permille) {
+    if (!h->count) return 0;
+    // rank of the value, 1 based
+    uint32_t rank = ((uint64_t)h->count * permille + 999) / 1000;
+    if (rank < 1) rank = 1;
+    uint32_t seen = 0;
+    for (int i = 0; i < LUATT_HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) {
+            uint32_t high = bucket_high(i);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
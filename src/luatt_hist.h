@@ -0,0 +1,37 @@
+#ifndef LUATT_HIST_H
+#define LUATT_HIST_H
+
+// Log-linear (HDR style) histogram of microsecond values.
+//
+// Each power of two range is split into 2^LUATT_HIST_SUB_BITS linear
+// buckets, so any recorded value is within 25% of its bucket bounds.
+// Values past 2^LUATT_HIST_MAX_BITS land in the last bucket, max keeps
+// the exact value.
+//
+// Doesn't use any Arduino APIs, so it builds on the host too.
+
+#include <stdint.h>
+
+#define LUATT_HIST_SUB_BITS 2
+#define LUATT_HIST_MAX_BITS 24
+#define LUATT_HIST_BUCKETS ((LUATT_HIST_MAX_BITS - LUATT_HIST_SUB_BITS + 1) << LUATT_HIST_SUB_BITS)
+
+struct Luatt_Hist {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t bucket[LUATT_HIST_BUCKETS];
+};
+
+void Luatt_Hist_Reset(Luatt_Hist* h);
+void Luatt_Hist_Add(Luatt_Hist* h, uint32_t v);
+
+// Lowest value that goes in bucket i.
+uint32_t Luatt_Hist_Bucket_Low(int i);
+
+// Upper bound of the bucket holding the value at permille (0 to 1000)
+// of the recorded values, clamped to max. 0 if empty.
+uint32_t Luatt_Hist_Percentile(const Luatt_Hist* h, int permille);
+
+#endif
@@ -3,6 +3,36 @@
 
 #include "luatt_context.h"
 #include "luatt_loader.h"
+#include "luatt_output.h"
+#include "luatt_prof.h"
+#include "luatt_snap.h"
+#include "luatt_log.h"
+
+#if LUATT_DUAL_CORE
+// Input framing runs on core 1, where it writes to Serial directly. Its
+// lines go out under "sched", not the token of the last packet sent.
+class Input_Print : public Print {
+public:
+    size_t write(uint8_t ch) override {
+        return write(&ch, 1);
+    }
+
+    size_t write(const uint8_t* buf, size_t size) override {
+        char token[64];
+        strncpy(token, Serial.get_mux_token(), sizeof(token) - 1);
+        token[sizeof(token) - 1] = 0;
+        Serial.set_mux_token("sched");
+        size_t n = Serial.write(buf, size);
+        Serial.set_mux_token(token);
+        return n;
+    }
+    using Print::write;
+};
+
+static Input_Print Input_Out;
+#else
+#define Input_Out Luatt_Out
+#endif
 
 Luatt_Loader::Buffer_t::Buffer_t(char* static_buf, size_t static_buf_size) {
     if (static_buf) {
@@ -33,7 +63,7 @@ int Luatt_Loader::Buffer_t::add(int ch) {
         return -1;
     }
     if (len >= max_size) {
-        Serial.printf("error|%s:%i,input buffer overflow.\n", __FILE__, __LINE__);
+        Input_Out.printf(LUATT_ERROR "input buffer overflow.\n");
         overflow = true;
         return -1;
     }
@@ -46,14 +76,14 @@ int Luatt_Loader::Buffer_t::add(int ch) {
         }
         char* new_buf = (char*) realloc(buf, size);
         if (new_buf == 0) {
-            Serial.printf("error|%s:%i,realloc(%i) failed.\n", __FILE__, __LINE__, size);
+            Input_Out.printf(LUATT_ERROR "realloc(%i) failed.\n", (int)size);
             overflow = true;
             return -1;
         }
         buf = new_buf;
     }
     if (len == size) {
-        Serial.printf("error|%s:%i,input buffer overflow2.\n", __FILE__, __LINE__);
+        Input_Out.printf(LUATT_ERROR "input buffer overflow2.\n");
         overflow = true;
         return -1;
     }
@@ -61,14 +91,29 @@ int Luatt_Loader::Buffer_t::add(int ch) {
     return 0;
 }
 
+// Hand buf over to the caller and start a new one. Null if out of memory.
+char* Luatt_Loader::Buffer_t::detach() {
+    char* new_buf = (char*) malloc(1024);
+    if (!new_buf) return 0;
+    char* old = buf;
+    buf = new_buf;
+    size = 1024;
+    len = 0;
+    return old;
+}
+
 void Luatt_Loader::Buffer_t::reset() {
     len = 0;
     overflow = false;
 }
 
 Luatt_Loader::Luatt_Loader(char* static_buf, size_t static_buf_size)
-    : Buffer(static_buf, static_buf_size)
+    : Buffer(static_buf, static_buf_size), State_name("main")
+#if LUATT_DUAL_CORE
+    , Cmd_ring(Cmd_storage, sizeof(Cmd_storage))
+#endif
 {
+    memset(&Stats, 0, sizeof(Stats));
     Reset_Input();
 }
 
@@ -82,77 +127,357 @@ void Luatt_Loader::Reset_Input() {
     Raw_read = 0;
 }
 
+const Luatt_Loader::Command_Def Luatt_Loader::Commands[] = {
+    { "reset",   &Luatt_Loader::Command_Reset },
+    { "eval",    &Luatt_Loader::Command_Eval },
+    { "aeval",   &Luatt_Loader::Command_Eval_Async },
+    { "load",    &Luatt_Loader::Command_Load },
+    { "compile", &Luatt_Loader::Command_Compile },
+    { "msg",     &Luatt_Loader::Command_Msg },
+    { "hashes",  &Luatt_Loader::Command_Hashes },
+    { "stage",   &Luatt_Loader::Command_Stage },
+    { "commit",  &Luatt_Loader::Command_Commit },
+    { "abort",   &Luatt_Loader::Command_Abort },
+    { "close",   &Luatt_Loader::Command_Close },
+    { "prof",    &Luatt_Loader::Command_Prof },
+    { "snap",    &Luatt_Loader::Command_Snap },
+    { "stats",   &Luatt_Loader::Command_Stats },
+    { "logfmt",  &Luatt_Loader::Command_Logfmt },
+    { 0, 0 }
+};
+
+// Hand a complete command from input framing over to Execute(). With
+// LUATT_DUAL_CORE it goes through Cmd_ring to core 0.
 void Luatt_Loader::Run_Command() {
-    if (Args_n < 2) return;
+#if LUATT_DUAL_CORE
+    Command c;
+    memcpy(c.args, Args, sizeof(Args));
+    c.args_n = Args_n;
+    c.owned = !Buffer.is_static;
+    if (c.owned) {
+        // core 0 frees it
+        c.buf = Buffer.detach();
+        if (!c.buf) {
+            Input_Out.printf(LUATT_ERROR "out of memory, command dropped.\n");
+            return;
+        }
+    }
+    else {
+        c.buf = Buffer.buf;
+    }
+    while (Cmd_ring.Free() < sizeof(c)) Luatt_Out.Drain();
+    Cmd_ring.Put(&c, sizeof(c));
+    Cmd_ring.Publish();
+
+    // static buffer gets reused for the next command, wait until done
+    if (!c.owned) {
+        while (!Cmd_ring.Drained()) Luatt_Out.Drain();
+    }
+#else
+    Cmd.buf = Buffer.buf;
+    memcpy(Cmd.args, Args, sizeof(Args));
+    Cmd.args_n = Args_n;
+    Cmd.owned = false;
+    int policy = Luatt_Out.set_policy(LUATT_OUT_BLOCK);
+    Execute();
+    Luatt_Out.set_policy(policy);
+#endif
+}
 
-    const char* token = Buffer.buf + Args[0].off;
-    Serial.set_mux_token(token);
+void Luatt_Loader::Execute() {
+    if (Cmd.args_n < 2) return;
+
+    const char* token = Cmd.buf + Cmd.args[0].off;
+    int id = Luatt_Out.intern_token(token);
+    if (id == LUATT_OUT_SCHED && strcmp(token, "sched")) {
+        // luatt.py matches the reply by token, collect handles to free
+        // one. Tokens still held belong to running tasks, don't take one.
+        for (int i = 0; i < LUATT_MAX_STATES; i++) {
+            lua_State* L = Lua_Get_State(i);
+            if (L) lua_gc(L, LUA_GCCOLLECT);
+        }
+        id = Luatt_Out.intern_token(token);
+        if (id == LUATT_OUT_SCHED) {
+            Luatt_Out.reply(token, LUATT_ERROR "every mux token is held.\n");
+            Luatt_Out.reply(token, "ret|fail\n");
+            return;
+        }
+    }
+    Luatt_Out.set_mux_token(id);
+
+    // cmd@name sends the command to the named Lua state
+    char* cmd = Cmd.buf + Cmd.args[1].off;
+    char* at = strchr(cmd, '@');
+    if (at) *at = 0;
+    State_name = at ? at + 1 : "main";
+    State_created = false;
+    if (!Lua_Select(State_name)) {
+        // reset@name adds a state
+        if (strcmp(cmd, "reset") || !Lua_Add_State(State_name) || !Lua_Select(State_name)) {
+            Luatt_Out.printf(LUATT_ERROR "no Lua state,%s\n", State_name);
+            Luatt_Out.print("ret|fail\n");
+            return;
+        }
+        State_created = true;
+    }
 
-    const char* cmd = Buffer.buf + Args[1].off;
-    if      (!strcmp(cmd, "reset")) Command_Reset();
-    else if (!strcmp(cmd,  "eval")) Command_Eval();
-    else if (!strcmp(cmd,  "load")) Command_Load();
-    else if (!strcmp(cmd,  "compile")) Command_Compile();
-    else if (!strcmp(cmd,   "msg")) Command_Msg();
+    Lua_Set_Owner(cmd);
+    static_assert(sizeof(Commands) / sizeof(Commands[0]) - 1 <= LUATT_MAX_COMMANDS,
+                  "Stats.commands[] is indexed by Commands[], raise LUATT_MAX_COMMANDS");
+    int i;
+    for (i = 0; Commands[i].name; i++) {
+        if (!strcmp(cmd, Commands[i].name)) break;
+    }
+    if (Commands[i].name) {
+        Stats.commands[i]++;
+        (this->*Commands[i].fn)();
+    }
     else {
         // unrecognized command
-        Serial.printf("error|%s:%i,bad command,%s\n", __FILE__, __LINE__, cmd);
-        Serial.print("ret|fail\n");
+        Stats.bad_commands++;
+        Luatt_Out.printf(LUATT_ERROR "bad command,%s\n", cmd);
+        Luatt_Out.print("ret|fail\n");
     }
+    // the command may have started threads, don't wait out a sleep
+    Lua_Wake(Lua_Target());
+    Lua_Select("main");
 }
 
 void Luatt_Loader::Command_Reset() {
-    Lua_Reset();
-    Serial.print("ret|ok\n");
+    if (State_created) {
+        // Lua_Add_State() just built it
+    }
+    else if (Cmd.args_n == 3 && !strcmp(Cmd.buf + Cmd.args[2].off, "soft")) {
+        Lua_Soft_Reset();
+    }
+    else {
+        Lua_Reset();
+    }
+    Luatt_Out.print("ret|ok\n");
     return;
 }
 
+// Build a new Lua state next to the running one. Following eval, load
+// and compile commands go to the new state until commit or abort.
+void Luatt_Loader::Command_Stage() {
+    if (!Lua_Stage_Begin()) {
+        Luatt_Out.printf(LUATT_ERROR "staged reset not available.\n");
+        Luatt_Out.print("ret|fail\n");
+        return;
+    }
+    Luatt_Out.print("ret|ok\n");
+}
+
+// Switch over to the staged state. Rolls back if any load failed.
+void Luatt_Loader::Command_Commit() {
+    if (!Lua_Stage_Commit()) {
+        Luatt_Out.printf(LUATT_ERROR "commit failed, old state kept.\n");
+        Luatt_Out.print("ret|fail\n");
+        return;
+    }
+    Luatt_Out.print("ret|ok\n");
+}
+
+void Luatt_Loader::Command_Abort() {
+    Lua_Stage_Abort();
+    Luatt_Out.print("ret|ok\n");
+}
+
+// Remove a named Lua state and free its memory.
+void Luatt_Loader::Command_Close() {
+    if (!strcmp(State_name, "main")) {
+        Luatt_Out.printf(LUATT_ERROR "can't close main.\n");
+        Luatt_Out.print("ret|fail\n");
+        return;
+    }
+    Lua_Remove_State(State_name);
+    Luatt_Out.print("ret|ok\n");
+}
+
+// prof|start[|interval_us], prof|stop, prof|dump
+void Luatt_Loader::Command_Prof() {
+    const char* op = Cmd.args_n >= 3 ? Cmd.buf + Cmd.args[2].off : "";
+    if (!strcmp(op, "start")) {
+        uint32_t interval_us = Cmd.args_n >= 4 ? strtoul(Cmd.buf + Cmd.args[3].off, 0, 10) : 0;
+        if (!Luatt_Prof_Start(interval_us)) {
+            Luatt_Out.printf(LUATT_ERROR "profiler out of memory.\n");
+            Luatt_Out.print("ret|fail\n");
+            return;
+        }
+    }
+    else if (!strcmp(op, "stop")) {
+        Luatt_Prof_Stop();
+    }
+    else if (!strcmp(op, "dump")) {
+        Luatt_Prof_Dump();
+    }
+    else {
+        Luatt_Out.printf(LUATT_ERROR "bad prof op,%s\n", op);
+        Luatt_Out.print("ret|fail\n");
+        return;
+    }
+    Luatt_Out.print("ret|ok\n");
+}
+
+// snap [top_n], heap snapshot with the top_n largest tables, default 10.
+void Luatt_Loader::Command_Snap() {
+    int top_n = Cmd.args_n >= 3 ? atoi(Cmd.buf + Cmd.args[2].off) : 10;
+    if (!Luatt_Snapshot(Lua_Target(), top_n)) {
+        Luatt_Out.printf(LUATT_ERROR "snapshot out of memory.\n");
+        Luatt_Out.print("ret|fail\n");
+        return;
+    }
+    Luatt_Out.print("ret|ok\n");
+}
+
+// Send the log formats again, for a luatt.py that just connected.
+void Luatt_Loader::Command_Logfmt() {
+    Luatt_Log_Formats();
+    Luatt_Out.print("ret|ok\n");
+}
+
+// One stats line for the loader and Lua_Loop, then one per Lua state.
+// Fields are key=value, comma separated.
+void Luatt_Loader::Command_Stats() {
+    Luatt_Out.printf("stats|uptime_ms=%u,bytes_in=%u,bytes_out=%u,parse_errors=%u,overflows=%u,"
+        "bad_commands=%u,lua_errors=%u,loop_calls=%u,out_drops_oldest=%u,out_drops_newest=%u,"
+        "out_blocks=%u,out_tokens_full=%u",
+        (unsigned)millis(), (unsigned)Stats.bytes_in, (unsigned)Luatt_Out.bytes_out,
+        (unsigned)Stats.parse_errors, (unsigned)Stats.overflows, (unsigned)Stats.bad_commands,
+        (unsigned)Stats.lua_errors, (unsigned)Lua_Loop_Calls(), (unsigned)Luatt_Out.drops_oldest,
+        (unsigned)Luatt_Out.drops_newest, (unsigned)Luatt_Out.blocks,
+        (unsigned)Luatt_Out.tokens_full);
+    for (int i = 0; Commands[i].name; i++) {
+        Luatt_Out.printf(",cmd_%s=%u", Commands[i].name, (unsigned)Stats.commands[i]);
+    }
+    Luatt_Out.print("\n");
+
+    for (int i = 0; i < LUATT_MAX_STATES; i++) {
+        lua_State* L = Lua_Get_State(i);
+        if (!L) continue;
+        Luatt_Context* ctx = Lua_Context(L);
+        uint32_t errors = 0;
+        for (int cb = 0; cb < LUATT_CB_COUNT; cb++) {
+            errors += ctx->cb_stats[cb].errors;
+        }
+        Luatt_Heap* heap = Lua_Heap(L);
+        size_t in_use = heap ? heap->in_use : lua_gc(L, LUA_GCCOUNT) * 1024;
+        size_t peak = heap ? heap->peak : 0;
+        uint32_t allocs = heap ? heap->allocs : 0;
+        Luatt_Out.printf("stats|state=%s,ticks=%u,callback_errors=%u,overruns=%u,"
+            "gc_cycles=%u,heap=%u,heap_peak=%u,allocs=%u",
+            Lua_State_Name(i), (unsigned)ctx->cb_stats[LUATT_CB_SCHED_LOOP].calls,
+            (unsigned)errors, (unsigned)ctx->overruns, (unsigned)ctx->gc_cycles,
+            (unsigned)in_use, (unsigned)peak, (unsigned)allocs);
+        const Luatt_Hist* hist[] = { &ctx->tick_us, &ctx->late_us };
+        const char* hist_name[] = { "tick", "late" };
+        for (int h = 0; h < 2; h++) {
+            Luatt_Out.printf(",%s_p50=%u,%s_p99=%u,%s_max=%u",
+                hist_name[h], (unsigned)Luatt_Hist_Percentile(hist[h], 500),
+                hist_name[h], (unsigned)Luatt_Hist_Percentile(hist[h], 990),
+                hist_name[h], (unsigned)hist[h]->max);
+        }
+        for (int p = 0; p < LUATT_RESET_PHASES; p++) {
+            Luatt_Out.printf(",reset_%s_us=%u,reset_%s_bytes=%u",
+                Luatt_Reset_Phase_Names[p], (unsigned)ctx->reset_us[p],
+                Luatt_Reset_Phase_Names[p], (unsigned)ctx->reset_bytes[p]);
+        }
+        Luatt_Out.print("\n");
+    }
+    Luatt_Out.print("ret|ok\n");
+}
+
 void Luatt_Loader::Command_Eval() {
-    if (Args_n != 3) {
-        Serial.printf("error|%s:%i,eval requires 3 args, %i given.\n", __FILE__, __LINE__, Args_n);
-        Serial.print("ret|fail\n");
+    if (Cmd.args_n != 3) {
+        Luatt_Out.printf(LUATT_ERROR "eval requires 3 args, %i given.\n", Cmd.args_n);
+        Luatt_Out.print("ret|fail\n");
         return;
     }
 
-    int r = luaL_loadbufferx(LUA, Buffer.buf + Args[2].off, Args[2].len, "eval", "t");
+    lua_State* L = Lua_Target();
+    int r = luaL_loadbufferx(L, Cmd.buf + Cmd.args[2].off, Cmd.args[2].len, "eval", "t");
     if (r != LUA_OK) {
         // lua error
-        const char* err_str = lua_tostring(LUA, lua_gettop(LUA));
-        Serial.printf("error|%s:%i,%i,%s\n", __FILE__, __LINE__, r, err_str);
-        lua_pop(LUA, 1);
-        Serial.print("ret|fail\n");
+        const char* err_str = lua_tostring(L, lua_gettop(L));
+        Stats.lua_errors++;
+        LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+        lua_pop(L, 1);
+        Luatt_Out.print("ret|fail\n");
         return;
     }
 
-    r = lua_pcall(LUA, 0, LUA_MULTRET, 0);
+    Lua_Budget_Begin(L, Lua_Context(L)->eval_budget_us);
+    r = lua_pcall(L, 0, LUA_MULTRET, 0);
+    Lua_Budget_End(L);
     if (r != LUA_OK) {
-        const char* err_str = lua_tostring(LUA, lua_gettop(LUA));
-        Serial.printf("error|%s:%i,%i,%s\n", __FILE__, __LINE__, r, err_str);
-        lua_pop(LUA, 1);
-        Serial.print("ret|fail\n");
+        const char* err_str = lua_tostring(L, lua_gettop(L));
+        Stats.lua_errors++;
+        LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+        lua_pop(L, 1);
+        Luatt_Out.print("ret|fail\n");
         return;
     }
 
-    int n = lua_gettop(LUA);
+    int n = lua_gettop(L);
     if (n == 0) {
         // no results to print
     }
-    else if (!lua_checkstack(LUA, 1) || lua_getglobal(LUA, "print") != LUA_TFUNCTION) {
+    else if (!lua_checkstack(L, 1) || lua_getglobal(L, "print") != LUA_TFUNCTION) {
         // can't find print function
-        lua_pop(LUA, n);
+        lua_pop(L, n);
     }
     else {
         // move print func to bottom of args
-        lua_rotate(LUA, 1, 1);
+        lua_rotate(L, 1, 1);
 
-        r = lua_pcall(LUA, n, 0, 0);
+        r = lua_pcall(L, n, 0, 0);
         if (r != LUA_OK) {
             // ignore erro
-            lua_pop(LUA, 1);
+            lua_pop(L, 1);
         }
     }
 
-    Serial.print("ret|ok\n");
+    Luatt_Out.print("ret|ok\n");
+}
+
+// Like eval, but the chunk runs as a scheduler thread so it can
+// yield and sleep. The thread sends the ret line when it finishes.
+void Luatt_Loader::Command_Eval_Async() {
+    if (Cmd.args_n != 3) {
+        Luatt_Out.printf(LUATT_ERROR "aeval requires 3 args, %i given.\n", Cmd.args_n);
+        Luatt_Out.print("ret|fail\n");
+        return;
+    }
+
+    lua_State* L = Lua_Target();
+    int r = luaL_loadbufferx(L, Cmd.buf + Cmd.args[2].off, Cmd.args[2].len, "eval", "t");
+    if (r != LUA_OK) {
+        // lua error
+        const char* err_str = lua_tostring(L, lua_gettop(L));
+        Stats.lua_errors++;
+        LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+        lua_pop(L, 1);
+        Luatt_Out.print("ret|fail\n");
+        return;
+    }
+
+    // Lua function scheduler.spawn(fn)
+    // spawn captures the current mux token for the new thread
+    r = Lua_Call_Callback(L, LUATT_CB_SPAWN, 1, 0);
+    if (r == LUATT_NO_CALLBACK) {
+        Luatt_Out.printf(LUATT_ERROR "aeval requires the scheduler.\n");
+        Luatt_Out.print("ret|fail\n");
+        return;
+    }
+    if (r != LUA_OK) {
+        const char* err_str = lua_tostring(L, lua_gettop(L));
+        Stats.lua_errors++;
+        LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+        lua_pop(L, 1);
+        Luatt_Out.print("ret|fail\n");
+        return;
+    }
+    // no ret line here, the thread sends it
 }
 
 static int Dump_I;
@@ -162,151 +487,205 @@ int dump_output(lua_State* L, const void* p, size_t sz, void* arg) {
     const uint8_t* src = (const uint8_t*)p;
     while (sz > 0) {
         if (Dump_I >= 80) {
-            Serial.printf("\n");
-            Serial.printf("dump|%s|", name);
+            Luatt_Out.printf("\n");
+            Luatt_Out.printf("dump|%s|", name);
             Dump_I = 0;
         }
-        Serial.printf("%02x", *src++);
+        Luatt_Out.printf("%02x", *src++);
         sz--;
         Dump_I++;
     }
     return 0;
 }
 
+// FNV-1a, luatt.py computes the same hash to skip unchanged modules.
+static uint32_t module_hash(const char* data, size_t len) {
+    uint32_t h = 2166136261u;
+    while (len--) {
+        h ^= (uint8_t) *data++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void record_hash(lua_State* L, const char* name, const char* data, size_t len) {
+    lua_getfield(L, LUA_REGISTRYINDEX, "luatt_hashes");
+    lua_pushinteger(L, module_hash(data, len));
+    lua_setfield(L, -2, name);
+    lua_pop(L, 1);
+}
+
 void Luatt_Loader::CompileLua(const char* name, const char* lua, size_t lua_len) {
-    int r = luaL_loadbufferx(LUA, lua, lua_len, name, "t");
+    lua_State* L = Lua_Target();
+    int r = luaL_loadbufferx(L, lua, lua_len, name, "t");
     if (r != LUA_OK) {
-        const char* err_str = lua_tostring(LUA, lua_gettop(LUA));
-        Serial.printf("error|%s:%i,%i,%s\n", __FILE__, __LINE__, r, err_str);
-        lua_pop(LUA, 1);
-        Serial.print("ret|fail\n");
+        const char* err_str = lua_tostring(L, lua_gettop(L));
+        Stats.lua_errors++;
+        LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+        lua_pop(L, 1);
+        Luatt_Out.print("ret|fail\n");
         return;
     }
 
-    Serial.printf("dump|%s|", name);
+    Luatt_Out.printf("dump|%s|", name);
     Dump_I = 0;
-    lua_dump(LUA, dump_output, (void*)name, 0);
-    Serial.printf("\n");
+    lua_dump(L, dump_output, (void*)name, 0);
+    Luatt_Out.printf("\n");
 
-    lua_pop(LUA, 1);
-    Serial.print("ret|ok\n");
+    lua_pop(L, 1);
+    Luatt_Out.print("ret|ok\n");
     return;
 }
 
 void Luatt_Loader::LoadLua(const char* name, const char* lua, size_t lua_len) {
-    int r = luaL_loadbufferx(LUA, lua, lua_len, name, "t");
+    lua_State* L = Lua_Target();
+    Lua_Set_Owner(name);
+
+    int r = luaL_loadbufferx(L, lua, lua_len, name, "t");
     if (r != LUA_OK) {
-        const char* err_str = lua_tostring(LUA, lua_gettop(LUA));
-        Serial.printf("error|%s:%i,%i,%s\n", __FILE__, __LINE__, r, err_str);
-        lua_pop(LUA, 1);
-        Serial.print("ret|fail\n");
+        const char* err_str = lua_tostring(L, lua_gettop(L));
+        Stats.lua_errors++;
+        LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+        lua_pop(L, 1);
+        Lua_Stage_Fail();
+        Luatt_Out.print("ret|fail\n");
         return;
     }
 
-    r = lua_pcall(LUA, 0, 1, 0);
+    r = lua_pcall(L, 0, 1, 0);
     if (r != LUA_OK) {
-        const char* err_str = lua_tostring(LUA, lua_gettop(LUA));
-        Serial.printf("error|%s:%i,%i,%s\n", __FILE__, __LINE__, r, err_str);
-        lua_pop(LUA, 1);
-        Serial.print("ret|fail\n");
+        const char* err_str = lua_tostring(L, lua_gettop(L));
+        Stats.lua_errors++;
+        LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+        lua_pop(L, 1);
+        Lua_Stage_Fail();
+        Luatt_Out.print("ret|fail\n");
         return;
     }
 
-    if (lua_isnil(LUA, -1)) {
+    if (lua_isnil(L, -1)) {
         // Lua module returned nil.
-        lua_pop(LUA, 1);
+        lua_pop(L, 1);
     }
     else {
         // Assign module result to Luatt.pkgs
-        lua_getglobal(LUA, "Luatt");
-        lua_getfield(LUA, -1, "pkgs");
-        lua_remove(LUA, -2); // Luatt
-        lua_rotate(LUA, -2, 1);
-        lua_setfield(LUA, -2, name);
-        lua_pop(LUA, 1);
-    }
-    lua_gc(LUA, LUA_GCCOLLECT);
-    Serial.print("ret|ok\n");
+        lua_getglobal(L, "Luatt");
+        lua_getfield(L, -1, "pkgs");
+        lua_remove(L, -2); // Luatt
+        lua_rotate(L, -2, 1);
+        lua_setfield(L, -2, name);
+        lua_pop(L, 1);
+    }
+    record_hash(L, name, lua, lua_len);
+    Lua_Idle_Gc(L);
+    Luatt_Out.print("ret|ok\n");
 }
 
 void Luatt_Loader::LoadBin(const char* name, const char* bin, size_t bin_len) {
-    int r = luaL_loadbufferx(LUA, bin, bin_len, name, "b");
+    lua_State* L = Lua_Target();
+    Lua_Set_Owner(name);
+
+    int r = luaL_loadbufferx(L, bin, bin_len, name, "b");
     if (r != LUA_OK) {
-        const char* err_str = lua_tostring(LUA, lua_gettop(LUA));
-        Serial.printf("error|%s:%i,%i,%s\n", __FILE__, __LINE__, r, err_str);
-        lua_pop(LUA, 1);
-        Serial.print("ret|fail\n");
+        const char* err_str = lua_tostring(L, lua_gettop(L));
+        Stats.lua_errors++;
+        LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+        lua_pop(L, 1);
+        Lua_Stage_Fail();
+        Luatt_Out.print("ret|fail\n");
         return;
     }
 
-    r = lua_pcall(LUA, 0, 1, 0);
+    r = lua_pcall(L, 0, 1, 0);
     if (r != LUA_OK) {
-        const char* err_str = lua_tostring(LUA, lua_gettop(LUA));
-        Serial.printf("error|%s:%i,%i,%s\n", __FILE__, __LINE__, r, err_str);
-        lua_pop(LUA, 1);
-        Serial.print("ret|fail\n");
+        const char* err_str = lua_tostring(L, lua_gettop(L));
+        Stats.lua_errors++;
+        LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+        lua_pop(L, 1);
+        Lua_Stage_Fail();
+        Luatt_Out.print("ret|fail\n");
         return;
     }
 
-    if (lua_isnil(LUA, -1)) {
+    if (lua_isnil(L, -1)) {
         // Lua module returned nil.
-        lua_pop(LUA, 1);
+        lua_pop(L, 1);
     }
     else {
         // Assign module result to Luatt.pkgs
-        lua_getglobal(LUA, "Luatt");
-        lua_getfield(LUA, -1, "pkgs");
-        lua_remove(LUA, -2); // Luatt
-        lua_rotate(LUA, -2, 1);
-        lua_setfield(LUA, -2, name);
-        lua_pop(LUA, 1);
-    }
-    lua_gc(LUA, LUA_GCCOLLECT);
-    Serial.print("ret|ok\n");
+        lua_getglobal(L, "Luatt");
+        lua_getfield(L, -1, "pkgs");
+        lua_remove(L, -2); // Luatt
+        lua_rotate(L, -2, 1);
+        lua_setfield(L, -2, name);
+        lua_pop(L, 1);
+    }
+    record_hash(L, name, bin, bin_len);
+    Lua_Idle_Gc(L);
+    Luatt_Out.print("ret|ok\n");
 }
 
 void Luatt_Loader::Command_Load() {
-    if (Args_n != 4) {
-        Serial.printf("error|%s:%i,load requires 4 args, %i given.\n", __FILE__, __LINE__, Args_n);
-        Serial.print("ret|fail\n");
+    if (Cmd.args_n != 4) {
+        Luatt_Out.printf(LUATT_ERROR "load requires 4 args, %i given.\n", Cmd.args_n);
+        Luatt_Out.print("ret|fail\n");
         return;
     }
-    LoadLua(Buffer.buf + Args[2].off, Buffer.buf + Args[3].off, Args[3].len);
+    LoadLua(Cmd.buf + Cmd.args[2].off, Cmd.buf + Cmd.args[3].off, Cmd.args[3].len);
+}
+
+// Reports the hash of every module loaded since the last reset.
+void Luatt_Loader::Command_Hashes() {
+    lua_State* L = Lua_Target();
+    lua_getfield(L, LUA_REGISTRYINDEX, "luatt_hashes");
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        Luatt_Out.printf("hash|%s|%08lx\n", lua_tostring(L, -2),
+            (unsigned long)(uint32_t) lua_tointeger(L, -1));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    Luatt_Out.print("ret|ok\n");
 }
 
 void Luatt_Loader::Command_Compile() {
-    if (Args_n != 4) {
-        Serial.printf("error|%s:%i,compile requires 4 args, %i given.\n", __FILE__, __LINE__, Args_n);
-        Serial.print("ret|fail\n");
+    if (Cmd.args_n != 4) {
+        Luatt_Out.printf(LUATT_ERROR "compile requires 4 args, %i given.\n", Cmd.args_n);
+        Luatt_Out.print("ret|fail\n");
         return;
     }
-    CompileLua(Buffer.buf + Args[2].off, Buffer.buf + Args[3].off, Args[3].len);
+    CompileLua(Cmd.buf + Cmd.args[2].off, Cmd.buf + Cmd.args[3].off, Cmd.args[3].len);
 }
 
 void Luatt_Loader::Command_Msg() {
-    if (Args_n != 4) {
-        Serial.printf("error|%s:%i,msg requires 4 args, %i given.\n", __FILE__, __LINE__, Args_n);
-        Serial.print("ret|fail\n");
+    if (Cmd.args_n != 4) {
+        Luatt_Out.printf(LUATT_ERROR "msg requires 4 args, %i given.\n", Cmd.args_n);
+        Luatt_Out.print("ret|fail\n");
         return;
     }
 
-    // Lua function MQ.OnMessage(topic, payload)
-    int r = lua_getfield(LUA, LUA_REGISTRYINDEX, "luatt_on_msg");
-    if (r != LUA_TFUNCTION) {
-        lua_pop(LUA, 1);
-        return;
-    }
+    // Lua function MQ.OnMessage(topic, payload), in every state
+    for (int i = 0; i < LUATT_MAX_STATES; i++) {
+        lua_State* L = Lua_Get_State(i);
+        if (!L) continue;
 
-    // topic
-    lua_pushlstring(LUA, Buffer.buf + Args[2].off, Args[2].len);
+        // Short strings (up to 40 bytes) are interned, so a topic that's
+        // subscribed, or a payload that repeats, doesn't allocate.
 
-    // payload
-    lua_pushlstring(LUA, Buffer.buf + Args[3].off, Args[3].len);
+        // topic
+        lua_pushlstring(L, Cmd.buf + Cmd.args[2].off, Cmd.args[2].len);
 
-    r = lua_pcall(LUA, 2, 0, 0);
-    if (r != LUA_OK) {
-        const char* err_str = lua_tostring(LUA, lua_gettop(LUA));
-        Serial.printf("error|%s:%i,%i,%s\n", __FILE__, __LINE__, r, err_str);
+        // payload
+        lua_pushlstring(L, Cmd.buf + Cmd.args[3].off, Cmd.args[3].len);
+
+        int r = Lua_Call_Callback(L, LUATT_CB_ON_MSG, 2, 0);
+        if (r != LUA_OK && r != LUATT_NO_CALLBACK) {
+            const char* err_str = lua_tostring(L, lua_gettop(L));
+            Stats.lua_errors++;
+            LUATT_LOG(LUATT_ERROR "%i,%s", r, err_str);
+            lua_pop(L, 1);
+        }
+        Lua_Wake(L);
     }
 }
 
@@ -320,7 +699,7 @@ int Luatt_Loader::Parse_Line()
     int i = 0;
     while (p < Buffer.len) {
         if (i >= LUATT_MAX_ARGS) {
-            Serial.printf("error|%s:%i,too many args, limit %i.\n", __FILE__, __LINE__, LUATT_MAX_ARGS);
+            Input_Out.printf(LUATT_ERROR "too many args, limit %i.\n", LUATT_MAX_ARGS);
             return -1;
         }
         char* s = Buffer.buf + p;
@@ -349,7 +728,7 @@ int Luatt_Loader::Parse_Line()
             char* end = s + 1;
             unsigned long bytes = strtoul(end, &end, 10);
             if (*end || bytes >= Buffer.max_size) {
-                Serial.printf("error|%s:%i,invalid raw byte count '%s'\n", __FILE__, __LINE__, s);
+                Input_Out.printf(LUATT_ERROR "invalid raw byte count '%s'\n", s);
                 return -1;
             }
             Raw[Raw_n].arg_i = i;
@@ -360,7 +739,7 @@ int Luatt_Loader::Parse_Line()
     }
     if (final_empty_arg) {
         if (i >= LUATT_MAX_ARGS) {
-            Serial.printf("error|%s:%i,too many args, limit %i.\n", __FILE__, __LINE__, LUATT_MAX_ARGS);
+            Input_Out.printf(LUATT_ERROR "too many args, limit %i.\n", LUATT_MAX_ARGS);
             return -1;
         }
         Args[i].off = Buffer.len;
@@ -383,6 +762,7 @@ void Luatt_Loader::Feed_Char(int ch)
     }
 
     if (Buffer.add(ch) < 0) {
+        Stats.overflows++;
         return;
     }
 
@@ -392,6 +772,7 @@ void Luatt_Loader::Feed_Char(int ch)
             // strip newline
             Buffer.buf[--Buffer.len] = 0;
             if (Parse_Line() < 0) {
+                Stats.parse_errors++;
                 Reset_Input();
                 return;
             }
@@ -407,7 +788,8 @@ void Luatt_Loader::Feed_Char(int ch)
         Raw_read++;
         if (Raw_read == r.bytes + 1) {
             if (ch != '\n') {
-                Serial.printf("error|%s:%i,expected newline after raw block.\n", __FILE__, __LINE__);
+                Input_Out.printf(LUATT_ERROR "expected newline after raw block.\n");
+                Stats.parse_errors++;
                 Buffer.overflow = true;
                 return;
             }
@@ -427,7 +809,8 @@ void Luatt_Loader::Feed_Char(int ch)
     }
 }
 
-int Luatt_Loader::Loop()
+// Read from USB and frame commands.
+int Luatt_Loader::Read_Input()
 {
     int ms = 50;
     if (!connected) {
@@ -436,7 +819,7 @@ int Luatt_Loader::Loop()
             //digitalWrite(3, 1);
             connected = true;
             Reset_Input();
-            printf("version|luatt,0.0.1\n");
+            Input_Out.printf("version|luatt,0.0.1\n");
             ms = 0;
         }
     }
@@ -447,8 +830,48 @@ int Luatt_Loader::Loop()
     else while (Serial.available()) {
         int ch = Serial.read();
         if (ch == EOF) break;
+        Stats.bytes_in++;
         Feed_Char(ch);
         ms = 0;
     }
     return ms;
 }
+
+#if LUATT_DUAL_CORE
+
+// Core 0, run the commands core 1 framed.
+int Luatt_Loader::Loop()
+{
+    int ms = 50;
+    while (Cmd_ring.Available() >= sizeof(Cmd)) {
+        Cmd_ring.Get(&Cmd, sizeof(Cmd));
+        int policy = Luatt_Out.set_policy(LUATT_OUT_BLOCK);
+        Execute();
+        Luatt_Out.set_policy(policy);
+        if (Cmd.owned) free(Cmd.buf);
+        Cmd_ring.Release();
+        ms = 0;
+    }
+    Luatt_Out.flush_lines(LUATT_OUT_LINE_MS);
+    return ms;
+}
+
+// Core 1
+int Luatt_Loader::Loop1()
+{
+    int ms = Read_Input();
+    if (Luatt_Out.Drain()) ms = 0;
+    return ms;
+}
+
+#else
+
+int Luatt_Loader::Loop()
+{
+    int ms = Read_Input();
+    Luatt_Out.flush_lines(LUATT_OUT_LINE_MS);
+    if (Luatt_Out.Drain()) ms = 0;
+    return ms;
+}
+
+#endif
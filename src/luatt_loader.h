@@ -3,7 +3,11 @@
 
 // Talks to luatt.py
 
+#include "luatt_output.h"
+#include "luatt_ring.h"
+
 #define LUATT_MAX_ARGS 6
+#define LUATT_MAX_COMMANDS 16
 
 class Luatt_Loader {
     bool connected;
@@ -21,6 +25,7 @@ class Luatt_Loader {
 
         int add(int ch);
         void reset();
+        char* detach();
     } Buffer;
 
 
@@ -30,6 +35,10 @@ class Luatt_Loader {
     } Args[LUATT_MAX_ARGS];
     int Args_n;
 
+    // Lua state the command is for, "main" unless sent as cmd@name.
+    const char* State_name;
+    bool State_created;     // reset@name just made it
+
 
     struct Raw {
         size_t arg_i; // index into Args[]
@@ -43,25 +52,72 @@ class Luatt_Loader {
     void Reset_Input();
     int Parse_Line();
 
+    struct Command_Def {
+        const char* name;
+        void (Luatt_Loader::*fn)();
+    };
+    static const Command_Def Commands[];
+
+    // A complete command, handed from input framing to Execute().
+    struct Command {
+        char* buf;
+        struct Arg args[LUATT_MAX_ARGS];
+        int args_n;
+        bool owned;     // buf was detached, free it when done
+    } Cmd;
+
+#if LUATT_DUAL_CORE
+    uint8_t Cmd_storage[512];
+    Luatt_Ring Cmd_ring;
+#endif
+
     void Run_Command();
+    void Execute();
+    int Read_Input();
     void Command_Reset();
     void Command_Eval();
+    void Command_Eval_Async();
     void Command_Load();
     void Command_Compile();
+    void Command_Hashes();
     void Command_Msg();
+    void Command_Stage();
+    void Command_Commit();
+    void Command_Abort();
+    void Command_Close();
+    void Command_Prof();
+    void Command_Snap();
+    void Command_Stats();
+    void Command_Logfmt();
 
     void Feed_Char(int ch);
 
     void CompileLua(const char* name, const char* lua, size_t lua_len);
 
 public:
+    // Counters for the stats command.
+    struct Stats_t {
+        uint32_t bytes_in;
+        uint32_t parse_errors;
+        uint32_t overflows;     // lines dropped by Buffer_t::overflow
+        uint32_t bad_commands;
+        uint32_t lua_errors;    // failed eval, load, msg, etc.
+        uint32_t commands[LUATT_MAX_COMMANDS];  // by Commands[] index
+    } Stats;
+
     Luatt_Loader(char* static_buf=0, size_t static_buf_size=0);
     ~Luatt_Loader();
 
     void LoadLua(const char* name, const char* lua, size_t lua_len);
     void LoadBin(const char* name, const char* bin, size_t bin_len);
 
+    // Call from loop(). With LUATT_DUAL_CORE this only runs commands,
+    // and Loop1() has to be called from loop1() on core 1 to read input
+    // and write output. Both return how long they could sleep in ms.
     int Loop();
+#if LUATT_DUAL_CORE
+    int Loop1();
+#endif
 };
 
 #endif
@@ -0,0 +1,211 @@
+#include <Arduino.h>
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luatt_output.h"
+#include "luatt_log.h"
+
+#define ESC 0x1b
+
+static const char* Formats[LUATT_LOG_FORMATS];
+static int Formats_n = 0;
+
+static bool needs_escape(uint8_t b) {
+    return b == '\n' || b == '\r' || b == '|' || b == '&' || b == ESC;
+}
+
+// Write escaped, in runs between the bytes that need it.
+static void put(const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*) data;
+    const uint8_t* end = p + len;
+    while (p < end) {
+        const uint8_t* q = p;
+        while (q < end && !needs_escape(*q)) q++;
+        Luatt_Out.write(p, q - p);
+        if (q == end) break;
+        uint8_t esc[2] = { ESC, (uint8_t)(*q ^ 0x20) };
+        Luatt_Out.write(esc, 2);
+        p = q + 1;
+    }
+}
+
+static void put_id(const char* kind, int id) {
+    char buf[16];
+    int n = snprintf(buf, sizeof(buf), "%s|%d|", kind, id);
+    Luatt_Out.write((const uint8_t*)buf, n);
+}
+
+// Own record, it can come in the middle of a line being printed.
+static void send_format(int id) {
+    Luatt_Out.begin_record();
+    put_id("logfmt", id);
+    put(Formats[id], strlen(Formats[id]));
+    Luatt_Out.write('\n');
+    Luatt_Out.end_record();
+}
+
+int Luatt_Log_Id(const char* fmt, bool copy) {
+#if LUATT_LOG_BINARY
+    for (int i = 0; i < Formats_n; i++) {
+        if (Formats[i] == fmt || !strcmp(Formats[i], fmt)) return i;
+    }
+    if (Formats_n == LUATT_LOG_FORMATS) return -1;
+    if (copy) {
+        char* c = (char*) malloc(strlen(fmt) + 1);
+        if (!c) return -1;
+        strcpy(c, fmt);
+        fmt = c;
+    }
+    Formats[Formats_n] = fmt;
+    send_format(Formats_n);
+    return Formats_n++;
+#else
+    return -1;
+#endif
+}
+
+void Luatt_Log_Formats() {
+    for (int i = 0; i < Formats_n; i++) send_format(i);
+}
+
+const char* Luatt_Log_Scan(const char* fmt, char* conv, char* mod) {
+    for (;;) {
+        fmt = strchr(fmt, '%');
+        if (!fmt) return 0;
+        fmt++;
+        if (*fmt == '%') {
+            fmt++;
+            continue;
+        }
+        fmt += strspn(fmt, "-+ #0");
+        while (isdigit((unsigned char)*fmt)) fmt++;
+        if (*fmt == '.') {
+            fmt++;
+            while (isdigit((unsigned char)*fmt)) fmt++;
+        }
+        *mod = 0;
+        if (*fmt == 'h') {
+            // promoted to int anyway
+            fmt++;
+            if (*fmt == 'h') fmt++;
+        }
+        else if (*fmt == 'l') {
+            fmt++;
+            *mod = 'l';
+            if (*fmt == 'l') {
+                fmt++;
+                *mod = 'L';
+            }
+        }
+        if (!*fmt) {
+            *conv = 0;
+            return fmt;
+        }
+        *conv = strchr("diucoxXeEfFgGs", *fmt) ? *fmt : 0;
+        return fmt + 1;
+    }
+}
+
+void Luatt_Log_Begin(int id) {
+    put_id("log", id);
+}
+
+void Luatt_Log_Uint(unsigned long long v) {
+    uint8_t buf[10];
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t) v;
+    put(buf, n);
+}
+
+void Luatt_Log_Int(long long v) {
+    Luatt_Log_Uint(((unsigned long long) v << 1) ^ (unsigned long long)(v >> 63));
+}
+
+void Luatt_Log_Double(double v) {
+    uint8_t buf[8];
+    memcpy(buf, &v, sizeof(buf));   // both targets are little-endian
+    put(buf, sizeof(buf));
+}
+
+void Luatt_Log_String(const char* s, size_t len) {
+    Luatt_Log_Uint(len);
+    put(s, len);
+}
+
+void Luatt_Log_End() {
+    Luatt_Out.write('\n');
+}
+
+// Same line as text, for formats without an id.
+static void log_text(const char* fmt, va_list ap) {
+    char buf[128];
+    va_list ap2;
+    va_copy(ap2, ap);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    if (n >= (int) sizeof(buf)) {
+        char* big = (char*) malloc(n + 1);
+        if (big) {
+            vsnprintf(big, n + 1, fmt, ap2);
+            Luatt_Out.write((const uint8_t*)big, n);
+            free(big);
+        }
+        else {
+            Luatt_Out.write((const uint8_t*)buf, sizeof(buf) - 1);
+        }
+    }
+    else if (n > 0) {
+        Luatt_Out.write((const uint8_t*)buf, n);
+    }
+    va_end(ap2);
+    Luatt_Out.write('\n');
+}
+
+void Luatt_Log(int* id, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (*id == -1) {
+        *id = Luatt_Log_Id(fmt, false);
+        // formats aren't removed, so it won't get an id later either
+        if (*id < 0) *id = -2;
+    }
+    if (*id < 0) {
+        log_text(fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    Luatt_Log_Begin(*id);
+    char conv, mod;
+    const char* p = fmt;
+    while ((p = Luatt_Log_Scan(p, &conv, &mod)) && conv) {
+        switch (conv) {
+        case 'd': case 'i': case 'c':
+            Luatt_Log_Int(mod == 'L' ? va_arg(ap, long long) :
+                          mod == 'l' ? va_arg(ap, long) : va_arg(ap, int));
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            Luatt_Log_Uint(mod == 'L' ? va_arg(ap, unsigned long long) :
+                           mod == 'l' ? va_arg(ap, unsigned long) : va_arg(ap, unsigned));
+            break;
+        case 's': {
+            const char* s = va_arg(ap, const char*);
+            if (!s) s = "(null)";
+            Luatt_Log_String(s, strlen(s));
+            break;
+        }
+        default:
+            Luatt_Log_Double(va_arg(ap, double));
+            break;
+        }
+    }
+    Luatt_Log_End();
+    va_end(ap);
+}
@@ -0,0 +1,70 @@
+#ifndef LUATT_LOG_H
+#define LUATT_LOG_H
+
+// Compact log lines, expanded back to text by luatt.py.
+//
+// A format string gets an id the first time it's used, announced with
+//   logfmt|<id>|<fmt>
+// and after that each line is sent as
+//   log|<id>|<args>
+// with the arguments in binary: integers as varints (signed ones
+// zigzagged), floats as 8 byte little-endian doubles, strings as a
+// varint length and the bytes. Bytes that would end the line or field
+// (\n \r | & and ESC) are sent as ESC, byte ^ 0x20, in the format too.
+//
+// Formats are printf's without the newline, one line each. Conversions
+// are d i u c o x X e E f F g G s, with flags, width, precision and the
+// h, hh, l and ll length modifiers. luatt.py sends the logfmt command
+// when it connects to get the formats it missed.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 0 to print text lines instead.
+#ifndef LUATT_LOG_BINARY
+#define LUATT_LOG_BINARY 1
+#endif
+
+// Distinct formats, ids aren't reused. Lines whose format doesn't fit
+// are printed as text.
+#ifndef LUATT_LOG_FORMATS
+#define LUATT_LOG_FORMATS 64
+#endif
+
+#define LUATT_STR_(x) #x
+#define LUATT_STR(x) LUATT_STR_(x)
+
+// Start of an error line's format, with the file and line in the literal
+// rather than sent with every line: LUATT_LOG(LUATT_ERROR "%i,%s", ...)
+#define LUATT_ERROR "error|" __FILE__ ":" LUATT_STR(__LINE__) ","
+
+// Log a line. fmt must be a literal, the call site keeps its id.
+#define LUATT_LOG(fmt, ...) do { \
+    static int luatt_log_id_ = -1; \
+    Luatt_Log(&luatt_log_id_, fmt, ##__VA_ARGS__); \
+} while (0)
+
+void Luatt_Log(int* id, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Id of fmt, adding it and sending its logfmt line if it's new. With
+// copy, fmt is copied, otherwise it has to stay put. Returns -1 if
+// there's no room or LUATT_LOG_BINARY is off.
+int Luatt_Log_Id(const char* fmt, bool copy);
+
+// Next conversion in fmt after %% are skipped. Returns where to carry
+// on and sets conv, and mod to 'l' for l or 'L' for ll, or returns 0
+// when there are no more. conv is 0 for a bad conversion.
+const char* Luatt_Log_Scan(const char* fmt, char* conv, char* mod);
+
+// A log line by hand, for Luatt.log().
+void Luatt_Log_Begin(int id);
+void Luatt_Log_Int(long long v);
+void Luatt_Log_Uint(unsigned long long v);
+void Luatt_Log_Double(double v);
+void Luatt_Log_String(const char* s, size_t len);
+void Luatt_Log_End();
+
+// Send every format's logfmt line again.
+void Luatt_Log_Formats();
+
+#endif
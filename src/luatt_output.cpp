@@ -0,0 +1,325 @@
+#include <Arduino.h>
+#include "Adafruit_TinyUSB.h"
+
+#include "luatt_output.h"
+
+Luatt_Output Luatt_Out;
+
+// Records are: token length, token, line length, line. LUATT_OUT_KEEP
+// in the token length marks a protocol line, which is never dropped.
+// LUATT_OUT_PART marks a piece of a line longer than Line::buf; whether
+// it goes out was decided by its first piece, so Drain() leaves it.
+#define LUATT_OUT_KEEP 0x80
+#define LUATT_OUT_PART 0x40
+#define LUATT_OUT_FLAGS (LUATT_OUT_KEEP | LUATT_OUT_PART)
+
+static uint8_t Out_storage[LUATT_OUT_RING_SIZE];
+static Luatt_Ring Out_ring(Out_storage, sizeof(Out_storage));
+
+Luatt_Output::Luatt_Output() {
+    memset(tokens, 0, sizeof(tokens));
+    strcpy(tokens[LUATT_OUT_SCHED].name, "sched");
+    tokens[LUATT_OUT_SCHED].len = 5;
+    tokens[LUATT_OUT_SCHED].last_used = token_clock = 1;
+    token = LUATT_OUT_SCHED;
+    memset(lines, 0, sizeof(lines));
+    line = &lines[0];
+    memset(&aside, 0, sizeof(aside));
+    aside_from = 0;
+    policy = LUATT_OUT_POLICY;
+    rec_len = 0;
+    rec_off = 0;
+    pkt_len = 0;
+    bytes_out = 0;
+    drops_oldest = 0;
+    drops_newest = 0;
+    blocks = 0;
+    tokens_full = 0;
+}
+
+// producer
+
+// luatt.py waits for these
+static bool is_protocol(const uint8_t* buf, size_t len) {
+    return (len >= 4 && !memcmp(buf, "ret|", 4)) ||
+           (len >= 4 && !memcmp(buf, "sub|", 4)) ||
+           (len >= 6 && !memcmp(buf, "unsub|", 6));
+}
+
+bool Luatt_Output::Make_Room(size_t need, int p) {
+#if !LUATT_DUAL_CORE
+    // with LUATT_DUAL_CORE only core 1 may take records out, see Drain()
+    if (p == LUATT_OUT_DROP_OLDEST) {
+        while (Out_ring.Free() < need && Drop_Record(false)) drops_oldest++;
+        if (Out_ring.Free() >= need) return true;
+        // the rest is protocol lines, wait for them
+        p = LUATT_OUT_BLOCK;
+    }
+#endif
+    if (p == LUATT_OUT_BLOCK) {
+        blocks++;
+        while (Out_ring.Free() < need) {
+#if !LUATT_DUAL_CORE
+            if (!Drain()) yield();
+#endif
+        }
+        return true;
+    }
+    return false;
+}
+
+void Luatt_Output::Put_Record(const char* name, uint8_t name_len, uint8_t flags,
+                              const uint8_t* buf, uint8_t len) {
+    flags |= name_len;
+    Out_ring.Put(&flags, 1);
+    Out_ring.Put(name, name_len);
+    Out_ring.Put(&len, 1);
+    Out_ring.Put(buf, len);
+    Out_ring.Publish();
+}
+
+void Luatt_Output::Flush_Line(Line* l) {
+    if (!l->len) return;
+    const Token* t = &tokens[l->token];
+    uint8_t token_len = t->len;
+    size_t need = 2 + token_len + l->len;
+    bool more = l->buf[l->len - 1] != '\n';
+    // the rest of a line goes where its start went
+    bool keep = l->open ? l->keep : is_protocol(l->buf, l->len);
+    if (l->open && l->dropped) {
+        // counted with its start
+    }
+    else if (Out_ring.Free() < need &&
+             !Make_Room(need, keep || l->open ? LUATT_OUT_BLOCK : policy)) {
+        drops_newest++;
+        l->dropped = true;
+    }
+    else {
+        uint8_t flags = (keep ? LUATT_OUT_KEEP : 0) | (l->open || more ? LUATT_OUT_PART : 0);
+        Put_Record(t->name, token_len, flags, l->buf, l->len);
+        l->dropped = false;
+    }
+    l->open = more;
+    l->keep = keep;
+    release_token(l->token);
+    l->len = 0;
+
+#if !LUATT_DUAL_CORE
+    // don't wait for loop() if a lot is queued
+    if (Out_ring.Available() > Out_ring.Size() / 2) Drain();
+#endif
+}
+
+size_t Luatt_Output::write(uint8_t ch) {
+    return write(&ch, 1);
+}
+
+size_t Luatt_Output::write(const uint8_t* buf, size_t size) {
+    Line* l = line;
+    const uint8_t* end = buf + size;
+    while (buf < end) {
+        // a line goes out under one token
+        if (l->len && l->token != token) Flush_Line(l);
+        if (!l->len) {
+            // a line left open under another token isn't continued
+            if (l->token != token) l->open = false;
+            l->token = token;
+            l->start_ms = millis();
+            hold_token(token);
+        }
+
+        size_t n = end - buf;
+        if (n > sizeof(l->buf) - l->len) n = sizeof(l->buf) - l->len;
+        const uint8_t* nl = (const uint8_t*) memchr(buf, '\n', n);
+        if (nl) n = nl - buf + 1;
+        memcpy(l->buf + l->len, buf, n);
+        l->len += n;
+        buf += n;
+        if (nl || l->len == sizeof(l->buf)) Flush_Line(l);
+    }
+    bytes_out += size;
+    return size;
+}
+
+const void* Luatt_Output::set_line_owner(const void* owner) {
+    const void* old = line->owner;
+    if (owner == old) return old;
+    if (!owner) {
+        line = &lines[0];
+        return old;
+    }
+
+    // the owner's line, else an empty one, else the oldest
+    Line* spare = 0;
+    for (int i = 1; i < LUATT_OUT_LINES; i++) {
+        Line* l = &lines[i];
+        if (l->owner == owner) {
+            line = l;
+            return old;
+        }
+        if (!spare || (spare->len && (!l->len || (int32_t)(l->start_ms - spare->start_ms) < 0))) {
+            spare = l;
+        }
+    }
+    Flush_Line(spare);
+    spare->owner = owner;
+    spare->open = false;
+    line = spare;
+    return old;
+}
+
+void Luatt_Output::begin_record() {
+    aside_from = line;
+    line = &aside;
+}
+
+void Luatt_Output::end_record() {
+    Flush_Line(&aside);
+    aside.open = false;
+    line = aside_from;
+}
+
+void Luatt_Output::flush_lines(uint32_t older_than_ms) {
+    uint32_t now = millis();
+    for (int i = 1; i < LUATT_OUT_LINES; i++) {
+        Line* l = &lines[i];
+        if (l->len && now - l->start_ms >= older_than_ms) Flush_Line(l);
+    }
+}
+
+int Luatt_Output::intern_token(const char* name) {
+    const size_t max = sizeof(tokens[0].name) - 1;
+    int spare = -1;
+    for (int i = 0; i < LUATT_OUT_TOKENS; i++) {
+        Token* t = &tokens[i];
+        if (t->last_used && !strncmp(t->name, name, max)) return i;
+        if (i == LUATT_OUT_SCHED || i == token || t->refs) continue;
+        // unused ones have last_used 0 and go first
+        if (spare < 0 || t->last_used < tokens[spare].last_used) spare = i;
+    }
+    if (spare < 0) {
+        tokens_full++;
+        return LUATT_OUT_SCHED;
+    }
+    Token* t = &tokens[spare];
+    strncpy(t->name, name, max);
+    t->name[max] = 0;
+    t->len = strlen(t->name);
+    t->last_used = ++token_clock;
+    t->owner.gen = 0;
+    return spare;
+}
+
+void Luatt_Output::reply(const char* token, const char* s) {
+    size_t token_len = strnlen(token, sizeof(tokens[0].name) - 1);
+    size_t len = strlen(s);
+    if (len > sizeof(lines[0].buf)) len = sizeof(lines[0].buf);
+    size_t need = 2 + token_len + len;
+    if (Out_ring.Free() < need) Make_Room(need, LUATT_OUT_BLOCK);
+    Put_Record(token, token_len, LUATT_OUT_KEEP, (const uint8_t*)s, len);
+}
+
+void Luatt_Output::hold_token(int id) {
+    tokens[id].refs++;
+}
+
+void Luatt_Output::release_token(int id) {
+    if (tokens[id].refs) tokens[id].refs--;
+}
+
+const char* Luatt_Output::token_name(int id) {
+    return tokens[id].name;
+}
+
+int Luatt_Output::token_owner(int id) {
+    return Luatt_Alloc_Owner_Ref_Id(&tokens[id].owner, tokens[id].name);
+}
+
+void Luatt_Output::set_mux_token(int id) {
+    if (id == token) return;
+    token = id;
+    tokens[id].last_used = ++token_clock;
+}
+
+int Luatt_Output::set_policy(int p) {
+    int old = policy;
+    policy = p;
+    return old;
+}
+
+// consumer
+
+void Luatt_Output::Get_Record() {
+    uint8_t n;
+    Out_ring.Get(&n, 1);
+    n &= ~LUATT_OUT_FLAGS;
+    Out_ring.Get(rec_token, n);
+    rec_token[n] = 0;
+    Out_ring.Get(&n, 1);
+    Out_ring.Get(rec, n);
+    Out_ring.Release();
+    rec_len = n;
+    rec_off = 0;
+}
+
+bool Luatt_Output::Drop_Record(bool force) {
+    uint8_t n;
+    Out_ring.Peek(&n, 1);
+    if ((n & LUATT_OUT_FLAGS) && !force) return false;
+    Out_ring.Skip(1 + (n & ~LUATT_OUT_FLAGS));
+    Out_ring.Get(&n, 1);
+    Out_ring.Skip(n);
+    Out_ring.Release();
+    return true;
+}
+
+bool Luatt_Output::Send_Packet() {
+    if (Serial.availableForWrite() < (int)pkt_len) return false;
+    Serial.set_mux_token(pkt_token);
+    Serial.write(pkt, pkt_len);
+    pkt_len = 0;
+    return true;
+}
+
+bool Luatt_Output::Drain() {
+    if (!Serial) {
+        // nobody listening, same as writing to a closed port
+        while (Out_ring.Available()) Drop_Record(true);
+        rec_off = rec_len;
+        pkt_len = 0;
+        return false;
+    }
+
+    bool any = false;
+    for (;;) {
+        if (rec_off == rec_len) {
+            if (!Out_ring.Available()) break;
+            Get_Record();
+            any = true;
+        }
+
+        // a packet holds output for one token
+        if (pkt_len == sizeof(pkt) || (pkt_len && strcmp(pkt_token, rec_token))) {
+            if (!Send_Packet()) {
+                // USB is stalled
+                if (policy == LUATT_OUT_DROP_OLDEST) {
+                    while (Out_ring.Available() > Out_ring.Size() * 3 / 4 && Drop_Record(false)) {
+                        drops_oldest++;
+                    }
+                }
+                return any;
+            }
+        }
+
+        if (!pkt_len) strcpy(pkt_token, rec_token);
+        size_t n = rec_len - rec_off;
+        if (n > sizeof(pkt) - pkt_len) n = sizeof(pkt) - pkt_len;
+        memcpy(pkt + pkt_len, rec + rec_off, n);
+        pkt_len += n;
+        rec_off += n;
+    }
+
+    // ring is empty, send the short packet now
+    if (pkt_len && Send_Packet()) Serial.flush();
+    return any;
+}
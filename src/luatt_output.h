@@ -0,0 +1,180 @@
+#ifndef LUATT_OUTPUT_H
+#define LUATT_OUTPUT_H
+
+// Output to luatt.py.
+//
+// Luatt code prints through Luatt_Out instead of Serial. Writes are
+// collected into whole lines and queued in a ring with their mux token,
+// and Drain() sends the ring to USB in full packets, only as fast as
+// USB takes them. With LUATT_DUAL_CORE, core 0 only queues lines and
+// core 1 drains them.
+
+#include <Arduino.h>
+
+#include "luatt_ring.h"
+#include "luatt_alloc.h"
+
+// RP2040 only. Run the loader's input framing and USB writes on core 1,
+// leaving core 0 to Lua. The sketch calls Luatt_Loader::Loop1() from
+// loop1(). Lua states must only be touched from core 0.
+#ifndef LUATT_DUAL_CORE
+#define LUATT_DUAL_CORE 0
+#endif
+
+#if LUATT_DUAL_CORE && !defined(ARDUINO_RASPBERRY_PI_PICO)
+#error "LUATT_DUAL_CORE needs an RP2040"
+#endif
+
+// Bytes of output queued for USB, power of two.
+#ifndef LUATT_OUT_RING_SIZE
+#define LUATT_OUT_RING_SIZE 4096
+#endif
+
+// Bytes per USB write, the CDC bulk packet size.
+#ifndef LUATT_OUT_PACKET
+#define LUATT_OUT_PACKET 64
+#endif
+
+// What to do with a line when the ring is full. ret|, sub| and unsub|
+// lines always wait, luatt.py would hang without them. A line is kept or
+// dropped whole, the rest of a long one waits if its start went out.
+enum {
+    LUATT_OUT_BLOCK,        // wait for USB
+    LUATT_OUT_DROP_OLDEST,  // throw away queued lines to fit it
+    LUATT_OUT_DROP_NEWEST,  // throw it away
+};
+
+#ifndef LUATT_OUT_POLICY
+#define LUATT_OUT_POLICY LUATT_OUT_DROP_NEWEST
+#endif
+
+// Mux tokens are interned, switching between them sets an index and
+// the name is only copied when a line is queued. Tokens held from Lua
+// are kept, the rest are reused least recently used first.
+#ifndef LUATT_OUT_TOKENS
+#define LUATT_OUT_TOKENS 32
+#endif
+
+// Token 0, always there.
+#define LUATT_OUT_SCHED 0
+
+// Line buffers for tasks resumed by Luatt.resume(), so their lines go
+// out whole even when another task writes under the same token before
+// they finish one. A partial line is kept across yields and written
+// when it's finished, the task ends, or it's LUATT_OUT_LINE_MS old.
+#ifndef LUATT_OUT_LINES
+#define LUATT_OUT_LINES 8
+#endif
+
+#ifndef LUATT_OUT_LINE_MS
+#define LUATT_OUT_LINE_MS 100
+#endif
+
+class Luatt_Output : public Print {
+    // producer
+    struct Token {
+        char name[64];
+        uint8_t len;
+        uint16_t refs;      // held from Lua
+        uint32_t last_used; // 0 if unused
+        Luatt_Alloc_Owner_Ref owner;    // memory is charged to its name
+    } tokens[LUATT_OUT_TOKENS];
+    uint32_t token_clock;
+    int token;
+
+    // lines[0] is for everything that isn't a task
+    struct Line {
+        const void* owner;  // the task's lua_State
+        int token;          // held while len > 0
+        uint32_t start_ms;
+        size_t len;
+        bool open;          // last piece queued didn't end the line
+        bool keep;          // its start was a protocol line
+        bool dropped;       // its start was dropped
+        uint8_t buf[128];
+    } lines[LUATT_OUT_LINES];
+    Line* line;
+    Line aside;         // see begin_record()
+    Line* aside_from;
+    volatile int policy;
+
+    void Put_Record(const char* name, uint8_t name_len, uint8_t flags,
+                    const uint8_t* buf, uint8_t len);
+    void Flush_Line(Line* l);
+    bool Make_Room(size_t need, int p);
+
+    // consumer, the record being sent and the packet it goes into
+    char rec_token[64];
+    uint8_t rec[128];
+    size_t rec_len;
+    size_t rec_off;
+    char pkt_token[64];
+    uint8_t pkt[LUATT_OUT_PACKET];
+    size_t pkt_len;
+
+    void Get_Record();
+    bool Drop_Record(bool force);
+    bool Send_Packet();
+
+public:
+    uint32_t bytes_out;
+
+    // Lines lost to the overflow policy. With LUATT_DUAL_CORE, core 1
+    // drops the oldest lines while USB is stalled and the ring is 3/4
+    // full, and core 0 drops the newest if that wasn't enough.
+    uint32_t drops_oldest;
+    uint32_t drops_newest;
+    uint32_t blocks;        // times a line waited for room
+    uint32_t tokens_full;   // interns that found every token held
+
+    Luatt_Output();
+
+    size_t write(uint8_t ch) override;
+    size_t write(const uint8_t* buf, size_t size) override;
+    using Print::write;
+
+    // Returns the token's id, adding it if it's new. If every token is
+    // held, returns LUATT_OUT_SCHED.
+    int intern_token(const char* token);
+    void hold_token(int id);
+    void release_token(int id);
+    const char* token_name(int id);
+    // Allocator owner for the token's name, looked up once.
+    int token_owner(int id);
+
+    // Queue whole protocol lines under a token without interning it, for
+    // the loader's reply when every token is held.
+    void reply(const char* token, const char* s);
+
+    // Send writes to the owner's line buffer, 0 for lines[0]. Returns the
+    // previous owner to switch back to.
+    const void* set_line_owner(const void* owner);
+
+    // Queue partial lines at least this old, 0 for all of them.
+    void flush_lines(uint32_t older_than_ms);
+    void flush_line() { Flush_Line(line); }
+
+    // Writes between these go out as their own lines, ahead of whatever
+    // partial line the current owner has. For lines the caller didn't
+    // ask for, like logfmt announcements.
+    void begin_record();
+    void end_record();
+
+    void set_mux_token(int id);
+    void set_mux_token(const char* token) { set_mux_token(intern_token(token)); }
+    const char* get_mux_token() { return tokens[token].name; }
+    int get_mux_token_id() { return token; }
+
+    // LUATT_OUT_*, returns the old one. The loader uses LUATT_OUT_BLOCK
+    // while it runs a command, since luatt.py waits for its reply.
+    int set_policy(int policy);
+
+    // Send queued lines to USB, as many as it has room for. Returns true
+    // if there were any. Called from Luatt_Loader::Loop(), or Loop1()
+    // with LUATT_DUAL_CORE.
+    bool Drain();
+};
+
+extern Luatt_Output Luatt_Out;
+
+#endif
@@ -0,0 +1,143 @@
+#include <Arduino.h>
+#include "Adafruit_TinyUSB.h"
+
+#include "luatt_context.h"
+#include "luatt_output.h"
+#include "luatt_prof.h"
+
+bool Luatt_Prof_Active = false;
+
+struct Prof_Frame {
+    uintptr_t key;      // source pointer and line defined
+    char label[40];     // name@source:line
+};
+
+struct Prof_Sample {
+    uint8_t depth;
+    uint8_t frame[LUATT_PROF_DEPTH];  // Prof_Frame index
+};
+
+static struct {
+    Prof_Frame* frames;
+    Prof_Sample* samples;
+    int frames_n;
+    uint32_t samples_n;     // total taken, ring index is modulo
+
+    uint32_t interval_us;
+    uint32_t last_us;
+    uint32_t start_us;
+    uint32_t elapsed_us;
+    uint32_t overhead_us;   // time spent sampling
+    uint32_t frames_full;   // frames recorded as "?"
+} Prof;
+
+bool Luatt_Prof_Start(uint32_t interval_us) {
+    Luatt_Prof_Active = false;
+    if (!Prof.frames) {
+        Prof.frames = (Prof_Frame*) malloc(LUATT_PROF_FRAMES * sizeof(Prof_Frame));
+        Prof.samples = (Prof_Sample*) malloc(LUATT_PROF_SAMPLES * sizeof(Prof_Sample));
+        if (!Prof.frames || !Prof.samples) {
+            free(Prof.frames);
+            free(Prof.samples);
+            Prof.frames = 0;
+            Prof.samples = 0;
+            return false;
+        }
+    }
+    Prof.frames_n = 0;
+    Prof.samples_n = 0;
+    Prof.interval_us = interval_us ? interval_us : 1000;
+    Prof.overhead_us = 0;
+    Prof.frames_full = 0;
+    Prof.elapsed_us = 0;
+    Prof.start_us = micros();
+    Prof.last_us = Prof.start_us;
+    Luatt_Prof_Active = true;
+    return true;
+}
+
+void Luatt_Prof_Stop() {
+    if (!Luatt_Prof_Active) return;
+    Luatt_Prof_Active = false;
+    Prof.elapsed_us = micros() - Prof.start_us;
+}
+
+// Characters that would break the folded stack or serial format.
+static void clean_label(char* s) {
+    for (; *s; s++) {
+        if (*s == '|' || *s == ';' || *s == ' ' || *s < 32) *s = '_';
+    }
+}
+
+static int frame_id(lua_Debug* ar) {
+    uintptr_t key = (uintptr_t)ar->source ^ ((uintptr_t)ar->linedefined << 20);
+    // C functions all share one source
+    if (*ar->what == 'C') key ^= (uintptr_t)ar->name;
+    for (int i = 0; i < Prof.frames_n; i++) {
+        if (Prof.frames[i].key == key) return i;
+    }
+    if (Prof.frames_n == LUATT_PROF_FRAMES) {
+        Prof.frames_full++;
+        return 0xff;
+    }
+    Prof_Frame* f = &Prof.frames[Prof.frames_n];
+    f->key = key;
+    snprintf(f->label, sizeof(f->label), "%s@%s:%i",
+        ar->name ? ar->name : "?", ar->short_src, ar->linedefined);
+    clean_label(f->label);
+    return Prof.frames_n++;
+}
+
+void Luatt_Prof_Sample(lua_State* L) {
+    uint32_t now = micros();
+    if (now - Prof.last_us < Prof.interval_us) return;
+
+    Prof_Sample* s = &Prof.samples[Prof.samples_n % LUATT_PROF_SAMPLES];
+    lua_Debug ar;
+    int depth = 0;
+    while (depth < LUATT_PROF_DEPTH && lua_getstack(L, depth, &ar)) {
+        lua_getinfo(L, "Sn", &ar);
+        s->frame[depth++] = frame_id(&ar);
+    }
+    s->depth = depth;
+    Prof.samples_n++;
+
+    Prof.last_us = micros();
+    Prof.overhead_us += Prof.last_us - now;
+}
+
+void Luatt_Prof_Dump() {
+    Luatt_Prof_Stop();
+    uint32_t n = Prof.samples_n;
+    if (n > LUATT_PROF_SAMPLES) n = LUATT_PROF_SAMPLES;
+
+    Luatt_Out.printf("prof|stats|%u|%u|%u|%u|%u\n", (unsigned)Prof.samples_n,
+        (unsigned)n, (unsigned)Prof.elapsed_us, (unsigned)Prof.overhead_us,
+        (unsigned)Prof.frames_full);
+    if (!Prof.samples) return;
+
+    // Merge identical stacks. Counted ones get depth 0xff.
+    for (uint32_t i = 0; i < n; i++) {
+        Prof_Sample* s = &Prof.samples[i];
+        if (s->depth == 0xff) continue;
+        int count = 1;
+        for (uint32_t j = i + 1; j < n; j++) {
+            Prof_Sample* t = &Prof.samples[j];
+            if (t->depth == s->depth && !memcmp(t->frame, s->frame, s->depth)) {
+                t->depth = 0xff;
+                count++;
+            }
+        }
+
+        // folded stacks are outermost first
+        Luatt_Out.print("prof|stack|");
+        for (int d = s->depth - 1; d >= 0; d--) {
+            int f = s->frame[d];
+            Luatt_Out.print(f < Prof.frames_n ? Prof.frames[f].label : "?");
+            if (d) Luatt_Out.print(";");
+        }
+        Luatt_Out.printf("|%i\n", count);
+    }
+    // stacks were consumed by the merge
+    Prof.samples_n = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef LUATT_PROF_H
+#define LUATT_PROF_H
+
+// Sampling profiler for Lua code.
+//
+// Piggybacks on the execution budget count hook: when the sample
+// interval has passed, the hook records the Lua call stack into a ring.
+// Only time spent running Lua bytecode gets sampled, not time blocked
+// in C functions.
+
+#include <stdint.h>
+
+struct lua_State;
+
+// Samples kept, oldest overwritten first.
+#ifndef LUATT_PROF_SAMPLES
+#define LUATT_PROF_SAMPLES 256
+#endif
+
+// Stack frames recorded per sample, innermost first.
+#ifndef LUATT_PROF_DEPTH
+#define LUATT_PROF_DEPTH 8
+#endif
+
+// Distinct functions per profile run.
+#ifndef LUATT_PROF_FRAMES
+#define LUATT_PROF_FRAMES 64
+#endif
+
+extern bool Luatt_Prof_Active;
+
+// Clears the previous profile. Returns false if out of memory.
+bool Luatt_Prof_Start(uint32_t interval_us);
+void Luatt_Prof_Stop();
+
+// Print prof|stats and prof|stack lines, folded stacks with counts.
+void Luatt_Prof_Dump();
+
+// Called from the count hook while active.
+void Luatt_Prof_Sample(struct lua_State* L);
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef LUATT_RING_H
+#define LUATT_RING_H
+
+// Lock-free single producer, single consumer byte ring.
+//
+// One side only calls the writer functions and the other only the
+// reader ones, each on its own core or thread. Writes become visible to
+// the reader all at once on Publish(), so a record can be put in parts.
+// Size must be a power of two.
+//
+// Doesn't use any Arduino APIs, so it builds on the host too.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+class Luatt_Ring {
+    uint8_t* buf;
+    uint32_t mask;
+    uint32_t head;      // written by the producer
+    uint32_t tail;      // written by the consumer
+    uint32_t put_at;    // producer's unpublished head
+    uint32_t get_at;    // consumer's unreleased tail
+
+public:
+    Luatt_Ring(void* storage, size_t size)
+        : buf((uint8_t*)storage), mask(size - 1),
+          head(0), tail(0), put_at(0), get_at(0) {}
+
+    size_t Size() const { return mask + 1; }
+
+    // producer
+
+    size_t Free() const {
+        return Size() - (put_at - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+    }
+
+    // Caller checks Free() first.
+    void Put(const void* data, size_t n) {
+        const uint8_t* p = (const uint8_t*)data;
+        size_t i = put_at & mask;
+        size_t first = Size() - i;
+        if (first > n) first = n;
+        memcpy(buf + i, p, first);
+        memcpy(buf, p + first, n - first);
+        put_at += n;
+    }
+
+    void Publish() {
+        __atomic_store_n(&head, put_at, __ATOMIC_RELEASE);
+    }
+
+    // consumer
+
+    size_t Available() const {
+        return __atomic_load_n(&head, __ATOMIC_ACQUIRE) - get_at;
+    }
+
+    // Caller checks Available() first.
+    void Get(void* data, size_t n) {
+        uint8_t* p = (uint8_t*)data;
+        size_t i = get_at & mask;
+        size_t first = Size() - i;
+        if (first > n) first = n;
+        memcpy(p, buf + i, first);
+        memcpy(p + first, buf, n - first);
+        get_at += n;
+    }
+
+    // Get() without moving past it.
+    void Peek(void* data, size_t n) const {
+        uint8_t* p = (uint8_t*)data;
+        size_t i = get_at & mask;
+        size_t first = Size() - i;
+        if (first > n) first = n;
+        memcpy(p, buf + i, first);
+        memcpy(p + first, buf, n - first);
+    }
+
+    void Skip(size_t n) {
+        get_at += n;
+    }
+
+    // Give the space read so far back to the producer.
+    void Release() {
+        __atomic_store_n(&tail, get_at, __ATOMIC_RELEASE);
+    }
+
+    // True once the consumer has released everything published.
+    bool Drained() const {
+        return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    }
+};
+
+#endif
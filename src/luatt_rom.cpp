@@ -0,0 +1,99 @@
+#include <string.h>
+
+#include "luatt_rom.h"
+
+#if LUATT_ROM_TABLES
+
+static int rom_find(const luaL_Reg* funcs, lua_State* L, int idx) {
+    if (lua_type(L, idx) != LUA_TSTRING) return -1;
+    const char* k = lua_tostring(L, idx);
+    for (int i = 0; funcs[i].name; i++) {
+        if (!strcmp(funcs[i].name, k)) return i;
+    }
+    return -1;
+}
+
+// __index, only reachable through the metatable so the userdata is ours
+static int rom_index(lua_State* L) {
+    const luaL_Reg* funcs = *(const luaL_Reg**) lua_touserdata(L, 1);
+    int i = rom_find(funcs, L, 2);
+    if (i < 0) lua_pushnil(L);
+    else lua_pushcfunction(L, funcs[i].func);
+    return 1;
+}
+
+static int rom_newindex(lua_State* L) {
+    return luaL_error(L, "read-only table");
+}
+
+static int rom_next(lua_State* L) {
+    const luaL_Reg* funcs = *(const luaL_Reg**) luaL_checkudata(L, 1, "luatt_rom");
+    int i = 0;
+    if (!lua_isnoneornil(L, 2)) {
+        i = rom_find(funcs, L, 2);
+        if (i < 0) return luaL_error(L, "invalid key to 'next'");
+        i++;
+    }
+    if (!funcs[i].name) return 0;
+    lua_pushstring(L, funcs[i].name);
+    lua_pushcfunction(L, funcs[i].func);
+    return 2;
+}
+
+static int rom_pairs(lua_State* L) {
+    lua_pushcfunction(L, rom_next);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+void Luatt_Rom_Push(lua_State* L, const luaL_Reg* funcs) {
+    const luaL_Reg** p = (const luaL_Reg**) lua_newuserdatauv(L, sizeof(*p), 0);
+    *p = funcs;
+
+    // one metatable per Lua state, shared by all ROM tables
+    if (luaL_newmetatable(L, "luatt_rom")) {
+        static const luaL_Reg meta[] = {
+            { "__index",    rom_index },
+            { "__newindex", rom_newindex },
+            { "__pairs",    rom_pairs },
+            { 0, 0 }
+        };
+        luaL_setfuncs(L, meta, 0);
+        lua_pushboolean(L, 0);
+        lua_setfield(L, -2, "__metatable");
+    }
+    lua_setmetatable(L, -2);
+}
+
+void Luatt_Rom_Index(lua_State* L, int idx, const luaL_Reg* funcs) {
+    idx = lua_absindex(L, idx);
+    if (lua_getmetatable(L, idx)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, idx);
+        luaL_setfuncs(L, funcs, 0);
+        lua_pop(L, 1);
+        return;
+    }
+    lua_createtable(L, 0, 1);
+    Luatt_Rom_Push(L, funcs);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, idx);
+}
+
+#else
+
+void Luatt_Rom_Push(lua_State* L, const luaL_Reg* funcs) {
+    int n = 0;
+    while (funcs[n].name) n++;
+    lua_createtable(L, 0, n);
+    luaL_setfuncs(L, funcs, 0);
+}
+
+void Luatt_Rom_Index(lua_State* L, int idx, const luaL_Reg* funcs) {
+    lua_pushvalue(L, idx);
+    luaL_setfuncs(L, funcs, 0);
+    lua_pop(L, 1);
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef LUATT_ROM_H
+#define LUATT_ROM_H
+
+// Read-only tables of C functions, in the spirit of eLua's rotables.
+//
+// A ROM table is a small userdata pointing at a static const luaL_Reg
+// array, and indexing it searches the array. The function names and
+// hash nodes stay in flash instead of taking Lua heap in every state
+// after every reset. Lookups are a linear search, so hot code should
+// keep the function in a local.
+//
+// Doesn't use any Arduino APIs, so it builds on the host too.
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
+
+// 0 builds ordinary tables instead, to compare heap use.
+#ifndef LUATT_ROM_TABLES
+#define LUATT_ROM_TABLES 1
+#endif
+
+// Push a read-only table of the functions in funcs, a static const,
+// null terminated array. pairs() works on it, assigning to it is an
+// error.
+void Luatt_Rom_Push(lua_State* L, const luaL_Reg* funcs);
+
+// Make keys missing from the table at idx fall through to funcs. The
+// table stays writable and a field set in it hides the function. If it
+// already has a metatable, funcs are copied in with luaL_setfuncs().
+void Luatt_Rom_Index(lua_State* L, int idx, const luaL_Reg* funcs);
+
+#endif
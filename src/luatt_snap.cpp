@@ -0,0 +1,351 @@
+#include <Arduino.h>
+#include "Adafruit_TinyUSB.h"
+
+#include "luatt_context.h"
+#include "luatt_output.h"
+#include "luatt_snap.h"
+
+enum {
+    SNAP_STRING,
+    SNAP_TABLE,
+    SNAP_FUNCTION,
+    SNAP_CFUNCTION,
+    SNAP_UPVALUE,
+    SNAP_USERDATA,
+    SNAP_THREAD,
+    SNAP_TYPES
+};
+
+static const char* const Snap_type_names[SNAP_TYPES] = {
+    "string", "table", "function", "cfunction", "upvalue", "userdata", "thread"
+};
+
+// Rough sizes of Lua 5.4 objects, from lobject.h and lstate.h.
+static const bool Wide = sizeof(void*) == 8;
+
+static size_t string_size(size_t len) {
+    return (Wide ? 24 : 16) + len + 1;
+}
+
+static size_t table_size(size_t array, size_t nodes) {
+    return (Wide ? 56 : 32) + array * 16 + nodes * 24;
+}
+
+static size_t lclosure_size(int nup) {
+    return (Wide ? 32 : 16) + nup * sizeof(void*);
+}
+
+static size_t cclosure_size(int nup) {
+    return (Wide ? 32 : 16) + nup * 16;
+}
+
+static size_t udata_size(size_t len, int nuv) {
+    return (nuv ? (Wide ? 40 : 24) + nuv * 16 : (Wide ? 32 : 16)) + len;
+}
+
+#define UPVAL_SIZE (Wide ? 40 : 32)
+
+// lua_State and its initial stack, more if the stack grew
+#define THREAD_SIZE ((Wide ? 200 : 112) + 45 * 16)
+
+struct Snap_Table {
+    size_t bytes;
+    int entries;
+    char path[LUATT_SNAP_PATH];
+};
+
+static struct {
+    uintptr_t* seen;    // open addressing, 0 is empty
+    size_t seen_size;   // power of two
+    size_t seen_n;
+    bool oom;
+
+    uint32_t count[SNAP_TYPES];
+    size_t bytes[SNAP_TYPES];
+
+    Snap_Table* top;    // largest tables, biggest first
+    int top_n;
+    int top_max;
+} Snap;
+
+static size_t seen_hash(uintptr_t p) {
+    return (p >> 3) * 2654435761u;
+}
+
+static bool seen_grow() {
+    size_t size = Snap.seen_size ? Snap.seen_size * 2 : 1024;
+    uintptr_t* seen = (uintptr_t*) calloc(size, sizeof(uintptr_t));
+    if (!seen) return false;
+    for (size_t i = 0; i < Snap.seen_size; i++) {
+        uintptr_t p = Snap.seen[i];
+        if (!p) continue;
+        size_t j = seen_hash(p) & (size - 1);
+        while (seen[j]) j = (j + 1) & (size - 1);
+        seen[j] = p;
+    }
+    free(Snap.seen);
+    Snap.seen = seen;
+    Snap.seen_size = size;
+    return true;
+}
+
+// True the first time ptr is seen.
+static bool seen_add(const void* ptr) {
+    uintptr_t p = (uintptr_t)ptr;
+    if (!p) return false;
+    if (Snap.seen_n * 2 >= Snap.seen_size && !seen_grow()) {
+        // stop going into new objects
+        Snap.oom = true;
+        return false;
+    }
+    size_t mask = Snap.seen_size - 1;
+    size_t i = seen_hash(p) & mask;
+    while (Snap.seen[i]) {
+        if (Snap.seen[i] == p) return false;
+        i = (i + 1) & mask;
+    }
+    Snap.seen[i] = p;
+    Snap.seen_n++;
+    return true;
+}
+
+static void count(int type, size_t bytes) {
+    Snap.count[type]++;
+    Snap.bytes[type] += bytes;
+}
+
+static void top_add(lua_State* L, int path_idx, size_t bytes, int entries) {
+    if (Snap.top_n == Snap.top_max) {
+        if (!Snap.top_max || bytes <= Snap.top[Snap.top_n - 1].bytes) return;
+        Snap.top_n--;
+    }
+    int i = Snap.top_n++;
+    for (; i > 0 && Snap.top[i - 1].bytes < bytes; i--) {
+        Snap.top[i] = Snap.top[i - 1];
+    }
+    const char* path = lua_tostring(L, path_idx);
+    Snap.top[i].bytes = bytes;
+    Snap.top[i].entries = entries;
+    snprintf(Snap.top[i].path, sizeof(Snap.top[i].path), "%s", path[0] ? path : "_G");
+}
+
+// Push the path at path_idx plus the key at key_idx, or plus seg if
+// key_idx is 0.
+static void push_path(lua_State* L, int path_idx, int key_idx, const char* seg) {
+    size_t len;
+    const char* parent = lua_tolstring(L, path_idx, &len);
+    if (len >= LUATT_SNAP_PATH - 1) {
+        lua_pushvalue(L, path_idx);
+        return;
+    }
+    char key[24];
+    if (key_idx) {
+        seg = key;
+        if (lua_type(L, key_idx) == LUA_TSTRING) {
+            seg = lua_tostring(L, key_idx);
+        }
+        else if (lua_isinteger(L, key_idx)) {
+            snprintf(key, sizeof(key), "[%lld]", (long long)lua_tointeger(L, key_idx));
+        }
+        else {
+            snprintf(key, sizeof(key), "[%s]", luaL_typename(L, key_idx));
+        }
+    }
+    // "a.b", but "a[1]", "f^upvalue" and "t<mt>"
+    bool dot = len && seg[0] != '[' && seg[0] != '^' && seg[0] != '<';
+    char path[LUATT_SNAP_PATH];
+    snprintf(path, sizeof(path), "%s%s%s", parent, dot ? "." : "", seg);
+    lua_pushstring(L, path);
+}
+
+// Queue the value at idx to be walked, with a path made from the one at
+// path_idx and key_idx or seg. Strings have nothing in them to walk, so
+// they're counted right away. Indices must be absolute.
+static void child(lua_State* L, int idx, int path_idx, int key_idx, const char* seg) {
+    int type = lua_type(L, idx);
+    if (type == LUA_TSTRING) {
+        if (seen_add(lua_topointer(L, idx))) {
+            count(SNAP_STRING, string_size(lua_rawlen(L, idx)));
+        }
+        return;
+    }
+    if (type != LUA_TTABLE && type != LUA_TFUNCTION &&
+        type != LUA_TUSERDATA && type != LUA_TTHREAD) return;
+    if (!seen_add(lua_topointer(L, idx))) return;
+    if (!lua_checkstack(L, 3)) {
+        luaL_error(L, "snapshot stack overflow");
+    }
+    lua_pushvalue(L, idx);
+    push_path(L, path_idx, key_idx, seg);
+}
+
+static void walk_metatable(lua_State* L, int v, int p) {
+    if (lua_getmetatable(L, v)) {
+        int t = lua_gettop(L);
+        child(L, t, p, 0, "<mt>");
+        lua_remove(L, t);
+    }
+}
+
+static void walk_table(lua_State* L, int v, int p) {
+    int entries = 0;
+    lua_pushnil(L);
+    while (lua_next(L, v)) {
+        int k = lua_gettop(L) - 1;
+        entries++;
+        child(L, k, p, 0, "<key>");
+        child(L, k + 1, p, k, 0);
+        // move the queued children under the key for lua_next()
+        lua_rotate(L, k, lua_gettop(L) - k - 1);
+        lua_pop(L, 1);
+    }
+    walk_metatable(L, v, p);
+
+    size_t array = lua_rawlen(L, v);
+    if (array > (size_t)entries) array = entries;
+    size_t hashed = entries - array;
+    size_t nodes = 0;
+    if (hashed) for (nodes = 1; nodes < hashed; nodes <<= 1);
+    size_t bytes = table_size(array, nodes);
+    count(SNAP_TABLE, bytes);
+    top_add(L, p, bytes, entries);
+}
+
+static void walk_function(lua_State* L, int v, int p) {
+    bool is_c = lua_iscfunction(L, v);
+    int n = 0;
+    const char* name;
+    while ((name = lua_getupvalue(L, v, n + 1))) {
+        n++;
+        int t = lua_gettop(L);
+        if (!is_c && seen_add(lua_upvalueid(L, v, n))) {
+            count(SNAP_UPVALUE, UPVAL_SIZE);
+        }
+        char seg[24];
+        snprintf(seg, sizeof(seg), "^%s", name[0] ? name : "?");
+        child(L, t, p, 0, seg);
+        lua_remove(L, t);
+    }
+    if (!is_c) count(SNAP_FUNCTION, lclosure_size(n));
+    else if (n) count(SNAP_CFUNCTION, cclosure_size(n));
+    // else a light C function, not an object
+}
+
+static void walk_userdata(lua_State* L, int v, int p) {
+    int nuv = 0;
+    for (;;) {
+        int t = lua_gettop(L) + 1;
+        if (lua_getiuservalue(L, v, nuv + 1) == LUA_TNONE) {
+            lua_pop(L, 1);
+            break;
+        }
+        nuv++;
+        child(L, t, p, 0, "<uv>");
+        lua_remove(L, t);
+    }
+    walk_metatable(L, v, p);
+    count(SNAP_USERDATA, udata_size(lua_rawlen(L, v), nuv));
+}
+
+// Move the top of co's stack over to L and queue it.
+static void thread_child(lua_State* L, lua_State* co, int p, const char* seg) {
+    lua_xmove(co, L, 1);
+    int t = lua_gettop(L);
+    child(L, t, p, 0, seg);
+    lua_remove(L, t);
+}
+
+static void walk_thread(lua_State* L, int v, int p) {
+    count(SNAP_THREAD, THREAD_SIZE);
+    lua_State* co = lua_tothread(L, v);
+    // our own stack is the work queue
+    if (co == L || !lua_checkstack(co, 1)) return;
+
+    lua_Debug ar;
+    for (int level = 0; lua_getstack(co, level, &ar); level++) {
+        lua_getinfo(co, "f", &ar);
+        thread_child(L, co, p, "<frame>");
+        for (int i = 1; lua_getlocal(co, &ar, i); i++) {
+            thread_child(L, co, p, "<local>");
+        }
+    }
+    // a new thread's function and args, or what a dead one left
+    int n = lua_gettop(co);
+    for (int i = 1; i <= n; i++) {
+        lua_pushvalue(co, i);
+        thread_child(L, co, p, "<stack>");
+    }
+}
+
+static int snap_walk(lua_State* L) {
+    // the object being walked and its path
+    lua_settop(L, 2);
+    int v = 1;
+    int p = 2;
+
+    // globals last so they're walked first and get the nicer paths
+    lua_pushvalue(L, LUA_REGISTRYINDEX);
+    seen_add(lua_topointer(L, -1));
+    lua_pushliteral(L, "reg");
+    lua_pushglobaltable(L);
+    seen_add(lua_topointer(L, -1));
+    lua_pushliteral(L, "");
+
+    while (lua_gettop(L) > p) {
+        lua_copy(L, -2, v);
+        lua_copy(L, -1, p);
+        lua_pop(L, 2);
+        switch (lua_type(L, v)) {
+        case LUA_TTABLE:    walk_table(L, v, p); break;
+        case LUA_TFUNCTION: walk_function(L, v, p); break;
+        case LUA_TUSERDATA: walk_userdata(L, v, p); break;
+        case LUA_TTHREAD:   walk_thread(L, v, p); break;
+        }
+    }
+    return 0;
+}
+
+bool Luatt_Snapshot(lua_State* L, int top_n) {
+    memset(&Snap, 0, sizeof(Snap));
+    if (top_n > 0) {
+        Snap.top = (Snap_Table*) calloc(top_n, sizeof(Snap_Table));
+        if (!Snap.top) return false;
+        Snap.top_max = top_n;
+    }
+
+    // leave out garbage
+    lua_gc(L, LUA_GCCOLLECT);
+    Luatt_Heap* heap = Lua_Heap(L);
+    size_t in_use = heap ? heap->in_use : lua_gc(L, LUA_GCCOUNT) * 1024;
+
+    bool ok = seen_grow();
+    if (ok) {
+        lua_pushcfunction(L, snap_walk);
+        ok = lua_pcall(L, 0, 0, 0) == LUA_OK;
+        if (!ok) lua_pop(L, 1);
+        ok = ok && !Snap.oom;
+    }
+
+    if (ok) {
+        uint32_t objects = 0;
+        size_t bytes = 0;
+        for (int i = 0; i < SNAP_TYPES; i++) {
+            if (!Snap.count[i]) continue;
+            Luatt_Out.printf("snap|type|%s|%u|%u\n", Snap_type_names[i],
+                (unsigned)Snap.count[i], (unsigned)Snap.bytes[i]);
+            objects += Snap.count[i];
+            bytes += Snap.bytes[i];
+        }
+        for (int i = 0; i < Snap.top_n; i++) {
+            Luatt_Out.printf("snap|table|%s|%u|%i\n", Snap.top[i].path,
+                (unsigned)Snap.top[i].bytes, Snap.top[i].entries);
+        }
+        Luatt_Out.printf("snap|total|%u|%u|%u\n", (unsigned)objects,
+            (unsigned)bytes, (unsigned)in_use);
+    }
+
+    free(Snap.seen);
+    free(Snap.top);
+    memset(&Snap, 0, sizeof(Snap));
+    return ok;
+}
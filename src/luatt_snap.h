@@ -0,0 +1,31 @@
+#ifndef LUATT_SNAP_H
+#define LUATT_SNAP_H
+
+// Heap snapshot of a Lua state, for finding what grows.
+//
+// Walks every object reachable from the globals and the registry and
+// prints counts and bytes by type, then the largest tables with their
+// path from the globals (or "reg." for the registry). Byte counts are
+// estimated from Lua 5.4's struct layouts since the API doesn't expose
+// them, and function prototypes can't be reached at all. The total
+// line has the heap in use to compare against.
+//
+// Output:
+//   snap|type|<type>|<count>|<bytes>
+//   snap|table|<path>|<bytes>|<entries>
+//   snap|total|<objects>|<bytes>|<heap in use>
+//
+// The seen set is malloc()ed outside the Lua heap, so the snapshot
+// doesn't count itself.
+
+struct lua_State;
+
+// Longest path kept for a table, longer ones are cut.
+#ifndef LUATT_SNAP_PATH
+#define LUATT_SNAP_PATH 64
+#endif
+
+// Returns false if out of memory.
+bool Luatt_Snapshot(struct lua_State* L, int top_n);
+
+#endif
@@ -0,0 +1,277 @@
+// Allocation benchmark: replays a trace of Lua allocator calls through
+// luatt_alloc and through libc realloc, and reports time per call and
+// how fragmented luatt's arena gets.
+//
+//   alloc_bench [-a arena_kb] [-p pool_kb] [-n repeats] [-o out.trace] [in]
+//
+// in is a .lua script to record a trace from, or a trace saved with -o.
+// Without it, a built-in workload is recorded: scheduler-like threads
+// churning strings, tables and closures. Recording refuses allocations
+// past 3/4 of the arena, like Luatt_Heap::ceiling, so Lua collects as
+// it would on the device.
+//
+// A trace is "LTRC" then 12 byte records of id, osize, nsize (uint32,
+// host order). Ids number blocks in the order Lua allocated them, with
+// NEW_BLOCK set on the call that allocates one, when osize is the Lua
+// type tag. nsize 0 frees.
+
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "luatt_alloc.h"
+
+#define NEW_BLOCK 0x80000000u
+
+struct Trace_Op {
+    uint32_t id;
+    uint32_t osize;
+    uint32_t nsize;
+};
+
+static std::vector<Trace_Op> Trace;
+static std::unordered_map<void*, uint32_t> Ids;
+static uint32_t Next_id;
+static size_t Record_ceiling;
+static size_t Record_live;
+
+static const char Workload_lua[] =
+    "local threads = {}\n"
+    "for t = 1, 6 do\n"
+    "    threads[t] = coroutine.create(function ()\n"
+    "        local cache = {}\n"
+    "        for i = 1, 4000 do\n"
+    "            local msg = string.format('sensor/%d|%d,%.2f', t, i, i * 0.37)\n"
+    "            cache[i % 32] = { msg = msg, n = #msg, parts = {} }\n"
+    "            for part in string.gmatch(msg, '[^|,]+') do\n"
+    "                table.insert(cache[i % 32].parts, part)\n"
+    "            end\n"
+    "            local f = function () return msg .. t end\n"
+    "            if i % 97 == 0 then cache = {} end\n"
+    "            if i % 251 == 0 then cache.big = string.rep(msg, 40) end\n"
+    "            coroutine.yield(f)\n"
+    "        end\n"
+    "    end)\n"
+    "end\n"
+    "local live = #threads\n"
+    "while live > 0 do\n"
+    "    live = 0\n"
+    "    for t = 1, #threads do\n"
+    "        if coroutine.resume(threads[t]) then live = live + 1 end\n"
+    "    end\n"
+    "end\n";
+
+// lua_Alloc that records each call.
+static void* record_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    size_t old = ptr ? osize : 0;
+    if (nsize > old && Record_live + nsize - old > Record_ceiling) return 0;
+    Record_live += nsize - old;
+
+    Trace_Op op;
+    if (ptr) {
+        op.id = Ids[ptr];
+    }
+    else {
+        if (!nsize) return 0;
+        op.id = Next_id++ | NEW_BLOCK;
+    }
+    op.osize = osize;
+    op.nsize = nsize;
+    Trace.push_back(op);
+
+    if (!nsize) {
+        Ids.erase(ptr);
+        free(ptr);
+        return 0;
+    }
+    void* p = realloc(ptr, nsize);
+    if (p != ptr) {
+        if (ptr) Ids.erase(ptr);
+        Ids[p] = op.id & ~NEW_BLOCK;
+    }
+    return p;
+}
+
+static bool record(const char* script) {
+    lua_State* L = lua_newstate(record_alloc, 0);
+    luaL_openlibs(L);
+    int r = script ? luaL_loadfile(L, script) : luaL_loadstring(L, Workload_lua);
+    if (r == LUA_OK) r = lua_pcall(L, 0, 0, 0);
+    if (r != LUA_OK) printf("error: %s\n", lua_tostring(L, -1));
+    lua_close(L);
+    return r == LUA_OK;
+}
+
+static bool load_trace(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return false;
+    char magic[4];
+    bool ok = fread(magic, 1, 4, f) == 4 && !memcmp(magic, "LTRC", 4);
+    Trace_Op op;
+    while (ok && fread(&op, sizeof(op), 1, f) == 1) {
+        Trace.push_back(op);
+        if (op.id & NEW_BLOCK) Next_id = (op.id & ~NEW_BLOCK) + 1;
+    }
+    fclose(f);
+    return ok;
+}
+
+static bool save_trace(const char* path) {
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    fwrite("LTRC", 1, 4, f);
+    fwrite(Trace.data(), sizeof(Trace_Op), Trace.size(), f);
+    return fclose(f) == 0;
+}
+
+static void* libc_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    if (!nsize) {
+        free(ptr);
+        return 0;
+    }
+    return realloc(ptr, nsize);
+}
+
+struct Result {
+    double ns_per_op;
+    uint32_t failures;
+    size_t peak;
+};
+
+// Replays the trace through f, leaving the blocks still live at the end
+// in blocks[] for the caller to inspect and free.
+static Result replay(lua_Alloc f, void* ud, std::vector<void*>& blocks) {
+    Result res = {};
+    size_t live = 0;
+    blocks.assign(Next_id, 0);
+    auto start = std::chrono::steady_clock::now();
+    for (const Trace_Op& op : Trace) {
+        uint32_t id = op.id & ~NEW_BLOCK;
+        void* ptr = (op.id & NEW_BLOCK) ? 0 : blocks[id];
+        if (!(op.id & NEW_BLOCK) && !ptr) continue;   // its allocation failed
+        void* p = f(ud, ptr, op.osize, op.nsize);
+        if (op.nsize && !p) {
+            res.failures++;
+            continue;
+        }
+        blocks[id] = p;
+        live += op.nsize;
+        live -= ptr ? op.osize : 0;
+        if (live > res.peak) res.peak = live;
+    }
+    auto end = std::chrono::steady_clock::now();
+    res.ns_per_op = std::chrono::duration<double, std::nano>(end - start).count() / Trace.size();
+    return res;
+}
+
+// Replays the trace through luatt_alloc again, untimed, looking at the
+// TLSF region every so often.
+static void fragmentation(size_t arena_kb, size_t pool_kb, std::vector<void*>& blocks) {
+    void* arena = malloc(arena_kb * 1024);
+    Luatt_Heap heap = {};
+    Luatt_Alloc_Begin(arena, arena_kb * 1024, pool_kb * 1024);
+    blocks.assign(Next_id, 0);
+    size_t every = Trace.size() / 200 + 1;
+    double frag_sum = 0, frag_max = 0;
+    size_t largest_min = (size_t)-1;
+    int samples = 0;
+    Luatt_Alloc_Stats stats;
+    for (size_t i = 0; i < Trace.size(); i++) {
+        const Trace_Op& op = Trace[i];
+        uint32_t id = op.id & ~NEW_BLOCK;
+        void* ptr = (op.id & NEW_BLOCK) ? 0 : blocks[id];
+        if (!(op.id & NEW_BLOCK) && !ptr) continue;
+        void* p = Luatt_Alloc(&heap, ptr, op.osize, op.nsize);
+        if (op.nsize && !p) continue;
+        blocks[id] = p;
+
+        if (i % every) continue;
+        Luatt_Alloc_Get_Stats(&stats);
+        double frag = stats.tlsf_free ? 1.0 - (double)stats.tlsf_largest_free / stats.tlsf_free : 0;
+        frag_sum += frag;
+        if (frag > frag_max) frag_max = frag;
+        if (stats.tlsf_largest_free < largest_min) largest_min = stats.tlsf_largest_free;
+        samples++;
+    }
+    Luatt_Alloc_Get_Stats(&stats);
+    printf("luatt arena %zu KB, pool %zu KB: %u small blocks fell back to TLSF\n",
+        arena_kb, pool_kb, (unsigned)stats.pool_fallbacks);
+    printf("luatt TLSF fragmentation over %d samples: mean %.1f%%, worst %.1f%%, "
+        "smallest largest free block %zu bytes\n",
+        samples, frag_sum / samples * 100, frag_max * 100, largest_min);
+    free(arena);
+}
+
+static void free_blocks(lua_Alloc f, void* ud, std::vector<void*>& blocks) {
+    for (void* p : blocks) {
+        if (p) f(ud, p, 0, 0);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t arena_kb = 192;
+    size_t pool_kb = 0;
+    int repeats = 5;
+    const char* out = 0;
+    const char* in = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-a") && i + 1 < argc) arena_kb = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc) pool_kb = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc) repeats = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc) out = argv[++i];
+        else in = argv[i];
+    }
+    if (!pool_kb) pool_kb = arena_kb / 4;
+    Record_ceiling = arena_kb * 1024 * 3 / 4;
+
+    size_t n = strlen(in ? in : "");
+    bool script = n > 4 && !strcmp(in + n - 4, ".lua");
+    if (in && !script) {
+        if (!load_trace(in)) {
+            printf("can't read trace %s\n", in);
+            return 1;
+        }
+    }
+    else if (!record(in)) {
+        return 1;
+    }
+    if (out && !save_trace(out)) {
+        printf("can't write %s\n", out);
+        return 1;
+    }
+
+    size_t news = 0;
+    for (const Trace_Op& op : Trace) news += (op.id & NEW_BLOCK) != 0;
+    printf("trace: %zu calls, %zu blocks\n", Trace.size(), news);
+
+    std::vector<void*> blocks;
+    void* arena = malloc(arena_kb * 1024);
+    Result best_luatt = {}, best_libc = {};
+    for (int r = 0; r < repeats; r++) {
+        Luatt_Heap heap = {};
+        Luatt_Alloc_Begin(arena, arena_kb * 1024, pool_kb * 1024);
+        Result res = replay(Luatt_Alloc, &heap, blocks);
+        if (!r || res.ns_per_op < best_luatt.ns_per_op) best_luatt = res;
+        free_blocks(Luatt_Alloc, &heap, blocks);
+
+        res = replay(libc_alloc, 0, blocks);
+        if (!r || res.ns_per_op < best_libc.ns_per_op) best_libc = res;
+        free_blocks(libc_alloc, 0, blocks);
+    }
+    free(arena);
+
+    printf("peak live: %zu bytes\n", best_libc.peak);
+    printf("%-6s %8s %9s\n", "", "ns/call", "failures");
+    printf("%-6s %8.1f %9u\n", "luatt", best_luatt.ns_per_op, (unsigned)best_luatt.failures);
+    printf("%-6s %8.1f %9u\n", "libc", best_libc.ns_per_op, (unsigned)best_libc.failures);
+    fragmentation(arena_kb, pool_kb, blocks);
+    return best_luatt.failures ? 1 : 0;
+}
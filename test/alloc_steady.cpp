@@ -0,0 +1,149 @@
+// Steady state allocation test: once a device is idling, ticking and
+// receiving messages, scheduler.loop and MQ.OnMessage must not allocate.
+//
+//   alloc_steady PriorityQueue.lua scheduler.lua MQ.lua
+//
+// Loads the core packages into the main state, turns MQ.log off, starts
+// a thread that wakes every millisecond and subscribes to a topic, then
+// counts Luatt_Heap::allocs across N ticks and N messages. The GC is stopped
+// while counting: after a collection Lua allocates some things again
+// once (CallInfos, short strings nothing refers to), which isn't per
+// event.
+
+#include <Arduino.h>
+
+#include "luatt.h"
+
+#define WARMUP 200
+#define EVENTS 2000
+
+static const char Setup_lua[] =
+    "local scheduler, MQ = Luatt.pkgs.scheduler, Luatt.pkgs.MQ\n"
+    "MQ.log = false\n"
+    "ticks, msgs = 0, 0\n"
+    "scheduler.start(coroutine.create(function ()\n"
+    "    while true do\n"
+    "        ticks = ticks + 1\n"
+    "        coroutine.yield(1)\n"
+    "    end\n"
+    "end))\n"
+    "scheduler.start(coroutine.create(function ()\n"
+    "    while true do\n"
+    "        coroutine.yield(60000, 1)\n"
+    "    end\n"
+    "end))\n"
+    "MQ.Subscribe('sensor/temp', function (topic, payload)\n"
+    "    msgs = msgs + 1\n"
+    "    last = payload\n"
+    "end)\n";
+
+static const char Msg[] = "x|msg|sensor/temp|21.5\n";
+
+static Luatt_Loader Loader;
+
+static bool load_file(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        printf("can't open %s\n", path);
+        return false;
+    }
+    static char buf[65536];
+    size_t len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    // package name is the file name without .lua
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    char name[64];
+    snprintf(name, sizeof(name), "%s", base);
+    char* dot = strrchr(name, '.');
+    if (dot) *dot = 0;
+
+    Loader.LoadLua(name, buf, len);
+    return true;
+}
+
+static void tick() {
+    Host_Advance_Us(1000);
+    Lua_Loop(0);
+    Loader.Loop();
+}
+
+static void message() {
+    Host_Serial_Input(Msg, sizeof(Msg) - 1);
+    Loader.Loop();
+}
+
+static lua_Integer get_int(const char* global) {
+    lua_getglobal(LUA, global);
+    lua_Integer n = lua_tointeger(LUA, -1);
+    lua_pop(LUA, 1);
+    return n;
+}
+
+static int check(const char* what, uint32_t allocs, lua_Integer events) {
+    printf("%-8s %6lld events, %u allocations\n", what, (long long)events, (unsigned)allocs);
+    if (events < EVENTS) {
+        printf("FAIL: %s only ran %lld times\n", what, (long long)events);
+        return 1;
+    }
+    if (allocs) {
+        printf("FAIL: %s allocates, %.3f per event\n", what, (double)allocs / events);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        printf("usage: %s PriorityQueue.lua scheduler.lua MQ.lua\n", argv[0]);
+        return 2;
+    }
+
+    Luatt_Config config;
+    config.idle_gc_us = 0;
+    Lua_Begin(0, &config);
+    Lua_Reset();
+    Luatt_Heap* heap = Lua_Heap(LUA);
+    if (!heap) {
+        printf("FAIL: main state isn't on the luatt allocator\n");
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (!load_file(argv[i])) return 2;
+    }
+    Loader.LoadLua("setup", Setup_lua, sizeof(Setup_lua) - 1);
+    Host_Serial_Clear();
+
+    // first runs size tables and intern strings, and again after the
+    // collection frees what was only needed once
+    for (int i = 0; i < WARMUP; i++) {
+        tick();
+        message();
+    }
+    lua_gc(LUA, LUA_GCCOLLECT);
+    lua_gc(LUA, LUA_GCSTOP);
+    for (int i = 0; i < WARMUP; i++) {
+        tick();
+        message();
+    }
+
+    int failed = 0;
+
+    lua_Integer ticks = get_int("ticks");
+    uint32_t allocs = heap->allocs;
+    for (int i = 0; i < EVENTS; i++) tick();
+    failed |= check("ticks", heap->allocs - allocs, get_int("ticks") - ticks);
+
+    lua_Integer msgs = get_int("msgs");
+    allocs = heap->allocs;
+    for (int i = 0; i < EVENTS; i++) message();
+    failed |= check("messages", heap->allocs - allocs, get_int("msgs") - msgs);
+
+    if (strstr(Host_serial_out ? Host_serial_out : "", "error|")) {
+        printf("FAIL: errors in output\n%s", Host_serial_out);
+        failed = 1;
+    }
+    printf(failed ? "FAIL\n" : "ok\n");
+    return failed;
+}
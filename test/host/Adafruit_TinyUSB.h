@@ -0,0 +1 @@
+// Serial's mux tokens are in the host Arduino.h.
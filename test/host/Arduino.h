@@ -0,0 +1,61 @@
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+// Just enough of the Arduino core to build luatt on the host. The clock
+// is simulated and only moves when a test advances it, apart from one
+// microsecond per micros() call so busy waits end. Serial reads from
+// Host_Serial_Input() and keeps what's written in Host_serial_out, and
+// can be stalled like a host that isn't reading.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void yield();
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t ch) = 0;
+    virtual size_t write(const uint8_t* buf, size_t size);
+    size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+    size_t print(const char* s) { return write(s); }
+    size_t printf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Host_Serial : public Print {
+public:
+    size_t write(uint8_t ch) override { return write(&ch, 1); }
+    size_t write(const uint8_t* buf, size_t size) override;
+    using Print::write;
+    int available();
+    int read();
+    int availableForWrite();
+    void flush() {}
+    operator bool() { return true; }
+    void set_mux_token(const char* token);
+    const char* get_mux_token();
+};
+
+extern Host_Serial Serial;
+
+void Host_Advance_Us(uint32_t us);
+
+// Queue bytes for Serial.read().
+void Host_Serial_Input(const char* data, size_t len);
+
+// USB takes nothing until yield() has been called this many times.
+void Host_Serial_Stall(uint32_t yields);
+
+// Everything written to Serial, each line prefixed with its mux token
+// and a |.
+extern char* Host_serial_out;
+extern size_t Host_serial_len;
+void Host_Serial_Clear();
+
+#endif
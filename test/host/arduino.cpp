@@ -0,0 +1,116 @@
+#include <stdarg.h>
+
+#include <Arduino.h>
+
+Host_Serial Serial;
+
+char* Host_serial_out;
+size_t Host_serial_len;
+static size_t Host_serial_cap;
+static char Mux_token[64] = "sched";
+static bool At_line_start = true;
+
+static char* Input;
+static size_t Input_len;
+static size_t Input_off;
+
+static uint64_t Clock_us;
+static uint32_t Stall_yields;
+
+uint32_t millis() {
+    return Clock_us / 1000;
+}
+
+uint32_t micros() {
+    return ++Clock_us;
+}
+
+void delay(uint32_t ms) {
+    Clock_us += (uint64_t)ms * 1000;
+}
+
+void Host_Advance_Us(uint32_t us) {
+    Clock_us += us;
+}
+
+void yield() {
+    if (Stall_yields) Stall_yields--;
+}
+
+size_t Print::write(const uint8_t* buf, size_t size) {
+    for (size_t i = 0; i < size; i++) write(buf[i]);
+    return size;
+}
+
+size_t Print::printf(const char* fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0) return 0;
+    if (n >= (int)sizeof(buf)) n = sizeof(buf) - 1;
+    return write((const uint8_t*)buf, n);
+}
+
+static void append(const void* data, size_t n) {
+    if (Host_serial_len + n + 1 > Host_serial_cap) {
+        Host_serial_cap = (Host_serial_len + n + 1) * 2;
+        Host_serial_out = (char*) realloc(Host_serial_out, Host_serial_cap);
+    }
+    memcpy(Host_serial_out + Host_serial_len, data, n);
+    Host_serial_len += n;
+    Host_serial_out[Host_serial_len] = 0;
+}
+
+size_t Host_Serial::write(const uint8_t* buf, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (At_line_start) {
+            append(Mux_token, strlen(Mux_token));
+            append("|", 1);
+        }
+        append(&buf[i], 1);
+        At_line_start = buf[i] == '\n';
+    }
+    return size;
+}
+
+int Host_Serial::availableForWrite() {
+    return Stall_yields ? 0 : 4096;
+}
+
+void Host_Serial_Stall(uint32_t yields) {
+    Stall_yields = yields;
+}
+
+int Host_Serial::available() {
+    return Input_len - Input_off;
+}
+
+int Host_Serial::read() {
+    if (Input_off == Input_len) return -1;
+    return (uint8_t) Input[Input_off++];
+}
+
+void Host_Serial_Input(const char* data, size_t len) {
+    // drop what's been read
+    memmove(Input, Input + Input_off, Input_len - Input_off);
+    Input_len -= Input_off;
+    Input_off = 0;
+    Input = (char*) realloc(Input, Input_len + len);
+    memcpy(Input + Input_len, data, len);
+    Input_len += len;
+}
+
+void Host_Serial::set_mux_token(const char* token) {
+    snprintf(Mux_token, sizeof(Mux_token), "%s", token);
+}
+
+const char* Host_Serial::get_mux_token() {
+    return Mux_token;
+}
+
+void Host_Serial_Clear() {
+    Host_serial_len = 0;
+    if (Host_serial_out) Host_serial_out[0] = 0;
+}
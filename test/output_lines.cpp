@@ -0,0 +1,125 @@
+// Output line test: lines longer than a line buffer go to USB whole or
+// not at all, under every overflow policy, while USB keeps stalling.
+//
+// A task writes numbered lines of up to 600 bytes in pieces, some of
+// them ret| lines, and USB stalls every few pieces so the ring overflows
+// between the pieces of a line. Every line that arrives must be exactly
+// as written, every ret| line must arrive, and arrived plus dropped must
+// add up.
+
+#include <Arduino.h>
+
+#include "luatt_output.h"
+
+#define LINES 600
+
+struct Writer {
+    int line;       // -1 between lines
+    bool ret;
+    size_t len;     // of the body
+    size_t off;
+};
+
+static int Next_line;
+static int Rets_written;
+
+static void start_line(Writer* w) {
+    w->line = Next_line++;
+    w->ret = w->line % 7 == 0;
+    w->len = (w->line * 37) % 600 + 10;
+    w->off = 0;
+    if (w->ret) Rets_written++;
+    Luatt_Out.printf("%sL%d:%u:", w->ret ? "ret|" : "", w->line, (unsigned)w->len);
+}
+
+// Writes some of w's line, up to all of it.
+static void write_some(Writer* w, size_t most) {
+    if (w->line < 0) start_line(w);
+    size_t n = w->len - w->off;
+    if (n > most) n = most;
+    char ch = 'a' + w->line % 26;
+    for (size_t i = 0; i < n; i++) Luatt_Out.write((uint8_t)ch);
+    w->off += n;
+    if (w->off == w->len) {
+        Luatt_Out.write((uint8_t)'\n');
+        w->line = -1;
+    }
+}
+
+// Checks one line as it reached the host, "t|" and all.
+static bool check_line(const char* s, size_t len, int* rets) {
+    if (len < 2 || memcmp(s, "t|", 2)) return false;
+    s += 2;
+    len -= 2;
+    if (len >= 4 && !memcmp(s, "ret|", 4)) {
+        (*rets)++;
+        s += 4;
+        len -= 4;
+    }
+    int line;
+    unsigned body;
+    int head;
+    if (sscanf(s, "L%d:%u:%n", &line, &body, &head) != 2) return false;
+    if ((size_t)head + body != len) return false;
+    for (size_t i = head; i < len; i++) {
+        if (s[i] != 'a' + line % 26) return false;
+    }
+    return true;
+}
+
+static int run(int policy, const char* name) {
+    Luatt_Out.set_policy(policy);
+    Luatt_Out.set_mux_token("t");
+    Host_Serial_Clear();
+    Next_line = 0;
+    Rets_written = 0;
+    uint32_t drops = Luatt_Out.drops_newest + Luatt_Out.drops_oldest;
+
+    // the task yields mid line, and loop() drains between resumes
+    Writer w = { -1 };
+    Luatt_Out.set_line_owner(&w);
+    for (int i = 0; Next_line < LINES || w.line >= 0; i++) {
+        write_some(&w, 50 + i % 200);
+        if (i % 20 == 0) Host_Serial_Stall(40);
+        Luatt_Out.Drain();
+    }
+    Luatt_Out.set_line_owner(0);
+    Host_Serial_Stall(0);
+    while (Luatt_Out.Drain()) {}
+
+    int failed = 0;
+    int lines = 0;
+    int rets = 0;
+    const char* s = Host_serial_out ? Host_serial_out : "";
+    while (*s) {
+        const char* nl = strchr(s, '\n');
+        if (!nl) nl = s + strlen(s);
+        if (!check_line(s, nl - s, &rets)) {
+            printf("FAIL: %s: bad line '%.*s'\n", name, (int)(nl - s < 80 ? nl - s : 80), s);
+            failed = 1;
+        }
+        lines++;
+        s = *nl ? nl + 1 : nl;
+    }
+    drops = Luatt_Out.drops_newest + Luatt_Out.drops_oldest - drops;
+    printf("%-12s %4d lines, %4d arrived, %4u dropped, %d/%d ret\n",
+        name, LINES, lines, (unsigned)drops, rets, Rets_written);
+    if (rets != Rets_written) {
+        printf("FAIL: %s: ret lines lost\n", name);
+        failed = 1;
+    }
+    if (lines + (int)drops != LINES) {
+        printf("FAIL: %s: lines unaccounted for\n", name);
+        failed = 1;
+    }
+    return failed;
+}
+
+int main() {
+    int failed = 0;
+    failed |= run(LUATT_OUT_DROP_NEWEST, "drop newest");
+    failed |= run(LUATT_OUT_DROP_OLDEST, "drop oldest");
+    failed |= run(LUATT_OUT_BLOCK, "block");
+    printf(failed ? "FAIL\n" : "ok\n");
+    return failed;
+}